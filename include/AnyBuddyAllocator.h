@@ -0,0 +1,200 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2020 Alan Chambers (unicycle.bloke@gmail.com)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+///////////////////////////////////////////////////////////////////////////////
+#pragma once
+#include "BuddyAllocator.h"
+#include "ConstexprBuddyAllocator.h"
+#include <mutex>
+#include <string_view>
+#include <utility>
+
+
+namespace ub {
+
+
+// Adapts ConstexprBuddyAllocator to the pointer interface of BuddyAllocator, so that
+// the two engines can be compared. The pool of 1 << MAX_POWER bytes is managed in 16
+// byte chunks. There is no order byte in front of each block, so a 16 byte request
+// takes 16 bytes rather than 32, and coalescing doesn't search the free lists. On the
+// other hand, the metadata held outside the pool is much larger.
+template <uint8_t MAX_POWER>
+class IndexedBuddyAllocator
+{
+public:
+    static constexpr uint8_t CHUNK_ORDER = 4;
+    static_assert(MAX_POWER > CHUNK_ORDER);
+
+    void* alloc(uint32_t size)
+    {
+        if (size == 0)
+        {
+            return nullptr;
+        }
+        auto index = m_pool.alloc((size + (1U << CHUNK_ORDER) - 1) >> CHUNK_ORDER);
+        return (index != Pool::NULL_INDEX) ? &m_pool[index] : nullptr;
+    }
+
+    void free(void* pointer)
+    {
+        if (pointer != nullptr)
+        {
+            m_pool.free(static_cast<typename Pool::Index>(static_cast<Chunk*>(pointer) - &m_pool[0]));
+        }
+    }
+
+private:
+    struct alignas(std::alignment_of_v<uint64_t>) Chunk
+    {
+        uint8_t bytes[1U << CHUNK_ORDER];
+    };
+
+    using Pool = ConstexprBuddyAllocator<MAX_POWER - CHUNK_ORDER, Chunk>;
+    Pool m_pool;
+};
+
+
+// Serialises calls to an engine with a mutex, for sharing one pool between threads.
+template <typename ENGINE>
+class LockedBuddyAllocator
+{
+public:
+    void* alloc(uint32_t size)
+    {
+        std::lock_guard<std::mutex> lock{m_mutex};
+        return m_engine.alloc(size);
+    }
+
+    void free(void* pointer)
+    {
+        std::lock_guard<std::mutex> lock{m_mutex};
+        m_engine.free(pointer);
+    }
+
+private:
+    std::mutex m_mutex;
+    ENGINE     m_engine;
+};
+
+
+// Type erased owner of an allocator engine, so that the engine can be chosen at startup
+// (for example, from configuration in order to A/B test engines) without rebuilding.
+// Each engine type has a single static table of functions which call it directly, so
+// alloc() and free() cost one indirect call over using the engine itself. Any type
+// with alloc(uint32_t) and free(void*) will do as an engine.
+class AnyBuddyAllocator
+{
+public:
+    AnyBuddyAllocator() = default;
+
+    AnyBuddyAllocator(AnyBuddyAllocator&& other) noexcept
+    : m_table{std::exchange(other.m_table, nullptr)}
+    , m_engine{std::exchange(other.m_engine, nullptr)}
+    {
+    }
+
+    AnyBuddyAllocator& operator=(AnyBuddyAllocator&& other) noexcept
+    {
+        std::swap(m_table, other.m_table);
+        std::swap(m_engine, other.m_engine);
+        return *this;
+    }
+
+    ~AnyBuddyAllocator()
+    {
+        if (m_table != nullptr)
+        {
+            m_table->destroy(m_engine);
+        }
+    }
+
+    // Creates an engine of the given type on the heap. Engines hold their pools, so
+    // this is one large allocation made once.
+    template <typename ENGINE>
+    static AnyBuddyAllocator make()
+    {
+        AnyBuddyAllocator result;
+        result.m_table  = &TABLE<ENGINE>;
+        result.m_engine = new ENGINE{};
+        return result;
+    }
+
+    // Empty if made by default, moved from, or the engine name was not recognised.
+    explicit operator bool() const
+    {
+        return m_table != nullptr;
+    }
+
+    void* alloc(uint32_t size)
+    {
+        return m_table->alloc(m_engine, size);
+    }
+
+    void free(void* pointer)
+    {
+        m_table->free(m_engine, pointer);
+    }
+
+private:
+    struct Table
+    {
+        void* (*alloc)(void* engine, uint32_t size);
+        void  (*free)(void* engine, void* pointer);
+        void  (*destroy)(void* engine);
+    };
+
+    template <typename ENGINE>
+    static constexpr Table TABLE
+    {
+        [](void* engine, uint32_t size) { return static_cast<ENGINE*>(engine)->alloc(size); },
+        [](void* engine, void* pointer) { static_cast<ENGINE*>(engine)->free(pointer); },
+        [](void* engine) { delete static_cast<ENGINE*>(engine); }
+    };
+
+private:
+    const Table* m_table{};
+    void*        m_engine{};
+};
+
+
+// Creates one of the standard engines for a pool of 1 << MAX_POWER bytes by name:
+// "freelist" for BuddyAllocator, or "indexed" for IndexedBuddyAllocator. If thread_safe
+// is set, the engine is wrapped in a LockedBuddyAllocator. Returns an empty allocator
+// if the name is not recognised.
+template <uint8_t MAX_POWER>
+AnyBuddyAllocator make_buddy_engine(std::string_view name, bool thread_safe = false)
+{
+    // The engines are too large to pass by value, so the type is passed as a null pointer.
+    auto make = [thread_safe](auto* type)
+    {
+        using Engine = std::remove_pointer_t<decltype(type)>;
+        return thread_safe ? AnyBuddyAllocator::make<LockedBuddyAllocator<Engine>>()
+                           : AnyBuddyAllocator::make<Engine>();
+    };
+
+    if (name == "freelist")
+    {
+        return make(static_cast<BuddyAllocator<MAX_POWER>*>(nullptr));
+    }
+    if (name == "indexed")
+    {
+        return make(static_cast<IndexedBuddyAllocator<MAX_POWER>*>(nullptr));
+    }
+    return {};
+}
+
+
+} // namespace ub {
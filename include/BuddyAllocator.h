@@ -22,14 +22,160 @@
 // same terms.
 //
 ///////////////////////////////////////////////////////////////////////////////
+#pragma once
 #include <type_traits>
 #include <cstdint>
 #include <algorithm>
+#include <atomic>
+#include <array>
+#include <cmath>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <new>
+#include <utility>
+#if __has_include(<execinfo.h>)
+#include <execinfo.h>
+#endif
 
 
 namespace ub {
 
 
+// Compile time options for BuddyAllocator. To change them, derive a struct from this 
+// one, hide the members you want to change, and pass it as the TRAITS parameter.
+struct BuddyTraits
+{
+    // Counters for monitoring: see BuddyAllocator::read_stats(). Each alloc() and free() 
+    // then updates a few counters, published through a seqlock. Occupancy caps are 
+    // worked out from the counters, so need them too.
+    static constexpr bool STATS = false;
+
+    // Number of allocation tags for which live bytes and counts are kept. Zero disables 
+    // tagging, and the out-of-band metadata which goes with it.
+    static constexpr uint16_t MAX_TAGS = 0;
+
+    // Mean number of bytes allocated between samples taken by the heap profiler. Zero
+    // disables sampling. Each sample records the stack of the allocation until it is 
+    // freed. At most MAX_SAMPLES sampled allocations can be live at once, and at most 
+    // MAX_STACKS distinct stacks are recorded: samples which don't fit are dropped.
+    static constexpr uint32_t SAMPLE_INTERVAL = 0;
+    static constexpr uint16_t MAX_SAMPLES     = 256;
+    static constexpr uint16_t MAX_STACKS      = 64;
+    static constexpr uint8_t  SAMPLE_DEPTH    = 16;
+
+    // Records the time of each allocation so that lifetimes can be reported by order and 
+    // by tag. Full records every allocation, Sampled only those chosen by the heap 
+    // profiler (which must be enabled). Ages are grouped into AGE_BUCKETS power of two 
+    // buckets of now() ticks.
+    enum class Ages { None, Sampled, Full };
+    static constexpr Ages    AGES        = Ages::None;
+    static constexpr uint8_t AGE_BUCKETS = 24;
+
+    // Where blocks are placed. Lifo reuses the most recently freed block of each order,
+    // which is fastest. TwoEnded keeps the free lists in address order. Orders below 
+    // LARGE_ORDER are served from the lowest free block of the smallest order which fits,
+    // and larger orders from the highest free block of any order which fits. Small 
+    // blocks then collect at the low end of the pool and stop fragmenting the regions
+    // which large allocations need. Adding a block to a free list then means 
+    // walking the list, which free() mostly does anyway to look for the buddy.
+    enum class Placement { Lifo, TwoEnded };
+    static constexpr Placement PLACEMENT   = Placement::Lifo;
+    static constexpr uint8_t   LARGE_ORDER = 12;
+
+    // Pre-split stashes of free blocks for the orders in most demand, so that alloc() 
+    // skips the search and splitting, and free() the coalescing. Allocations are counted 
+    // by order, and every STASH_PERIOD allocations the counts are folded into decayed 
+    // rates (half the old rate plus the new count). The orders with the highest rates 
+    // get stashes in proportion to their share of demand, for as long as the stashes fit
+    // in STASH_BYTES. Each stash then tunes itself from its own counters: its size and 
+    // the number of blocks refilled at once (starting at STASH_BATCH) grow while many 
+    // allocations find it empty or frees find it full, and shrink while some of its 
+    // blocks sit unused, up to STASH_DEPTH blocks. Idle blocks go back to the pool, or
+    // for a pool which is no longer used, when decay_stashes() is called. Zero 
+    // STASH_BYTES disables the stashes.
+    static constexpr uint32_t STASH_BYTES  = 0;
+    static constexpr uint8_t  STASH_DEPTH  = 16;
+    static constexpr uint8_t  STASH_BATCH  = 4;
+    static constexpr uint16_t STASH_PERIOD = 256;
+
+    // Number of subtrees detached from other allocators which can be adopted at once. 
+    // See BuddyAllocator::adopt(). Zero disables adoption, which costs nothing, and 
+    // otherwise free() makes one extra comparison. Can't be combined with tags, sampling
+    // or ages, since the out-of-band metadata of adopted blocks stays behind.
+    static constexpr uint8_t MAX_ADOPTED = 0;
+
+    // Splits the out-of-band metadata kept for tags, sampling and ages into regions of
+    // 1 << META_CHUNK_ORDER bytes of the pool. A region's metadata is only allocated, by
+    // alloc_metadata(), when a block within it is first handed out, and is given back 
+    // to free_metadata() when the region has coalesced into free blocks again. Memory
+    // for metadata then follows the memory in use rather than the size of the pool, and
+    // none is zeroed up front. alloc() fails if the metadata can't be allocated. Zero 
+    // keeps all the metadata in an array inside the allocator.
+    static constexpr uint8_t META_CHUNK_ORDER = 0;
+
+    // Must return zeroed memory, or nullptr.
+    static void* alloc_metadata(size_t size)
+    {
+        return std::calloc(1, size);
+    }
+
+    static void free_metadata(void* metadata)
+    {
+        std::free(metadata);
+    }
+
+    // Clock used for ages. Any free running tick count will do, as only differences are 
+    // used. Embedded targets will probably want to replace this with a hardware timer.
+    static uint32_t now()
+    {
+        using namespace std::chrono;
+        return static_cast<uint32_t>(duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count());
+    }
+
+    // Captures the current call stack for the heap profiler. Returns the number of frames 
+    // written. Replace this on platforms without <execinfo.h>.
+    static uint8_t backtrace(void** frames, uint8_t depth)
+    {
+#if __has_include(<execinfo.h>)
+        return static_cast<uint8_t>(::backtrace(frames, depth));
+#else
+        return 0;
+#endif
+    }
+};
+
+
+// A block detached from one BuddyAllocator, together with the allocations within it,
+// for adopting into another. The free blocks within it are chained through their first
+// bytes, in address order, each with its order following the link. See detach().
+struct BuddySubtree
+{
+    uint8_t* base{};
+    uint8_t  order{};
+    uint8_t* free_blocks{};
+
+    explicit operator bool() const
+    {
+        return base != nullptr;
+    }
+};
+
+
+// FNV-1a hash of a call site, for use as an allocation tag. Works with __FILE__ and 
+// __LINE__, or with the members of std::source_location in C++20.
+constexpr uint32_t site_tag(const char* file, uint32_t line)
+{
+    uint32_t hash = 2166136261U;
+    while (*file != 0)
+    {
+        hash = (hash ^ static_cast<uint8_t>(*file++)) * 16777619U;
+    }
+    return (hash ^ line) * 16777619U;
+}
+
+
 // Simple buddy allocator template adapted from a C implementation. Mainly intended 
 // for embedded applications, but could be used on any platform.
 // 
@@ -39,7 +185,7 @@ namespace ub {
 // usually work. You can have multiple instances with different size in the same 
 // program. The allocator could live on the stack, as a global object, as a member 
 // of some other class. It can be dynamically allocated if that makes sense. 
-template <uint8_t MAX_POWER, uint8_t ALIGNMENT = std::alignment_of_v<uint64_t>>
+template <uint8_t MAX_POWER, uint8_t ALIGNMENT = std::alignment_of_v<uint64_t>, typename TRAITS = BuddyTraits>
 class BuddyAllocator
 {
     // A convenience function for determining the minimum possibly block size.
@@ -62,29 +208,540 @@ public:
     static constexpr uint8_t MIN_ORDER = log2(sizeof(void*) + 1);
     static constexpr uint8_t MAX_ORDER = MAX_POWER;
 
+    static constexpr uint8_t  ORDERS   = MAX_ORDER - MIN_ORDER + 1;
+    static constexpr uint16_t MAX_TAGS = TRAITS::MAX_TAGS;
+    static constexpr uint32_t SAMPLE_INTERVAL = TRAITS::SAMPLE_INTERVAL;
+    static constexpr uint8_t  AGE_BUCKETS = TRAITS::AGE_BUCKETS;
+    static constexpr bool     TWO_ENDED   = (TRAITS::PLACEMENT == TRAITS::Placement::TwoEnded);
+
+    // Allocations are aligned to this, or to their block size if that is smaller.
+    static constexpr size_t BLOCK_ALIGNMENT = ALIGNMENT;
+
+    // The most a single allocation can hold.
+    static constexpr uint32_t LARGEST_SIZE = (1U << MAX_ORDER) - 1;
+
     static_assert((1U << MIN_ORDER) >= (sizeof(void*) + 1));
     static_assert(MAX_ORDER >= MIN_ORDER);
 
+    // Counters for a single order (block size). Live blocks is allocs - frees. Capped
+    // counts requests refused by an occupancy cap: see set_occupancy_cap().
+    struct OrderStats
+    {
+        uint32_t allocs;
+        uint32_t frees;
+        uint32_t free_blocks;
+        uint32_t capped;
+    };
+
+    // A consistent snapshot of the allocator's counters, as returned by read_stats().
+    struct Stats
+    {
+        OrderStats orders[ORDERS];
+        uint32_t   used_bytes;
+        uint32_t   free_bytes;
+        uint32_t   failures;
+    };
+
+    // Live totals for one allocation tag, as returned by read_tag_stats().
+    struct TagStats
+    {
+        uint32_t live_bytes;
+        uint32_t live_count;
+    };
+
+    // A call stack recorded by the heap profiler, with the totals for the sampled 
+    // allocations made from it. Cumulative totals include allocations since freed.
+    struct SampledStack
+    {
+        void*    frames[TRAITS::SAMPLE_DEPTH];
+        uint8_t  depth;
+        uint32_t live_count;
+        uint32_t live_bytes;
+        uint32_t total_count;
+        uint64_t total_bytes;
+    };
+
+    // Counts of allocations by age. Bucket i holds ages in [2^(i-1), 2^i) ticks, with 
+    // zero in bucket 0 and everything too old in the last bucket.
+    struct AgeHistogram
+    {
+        uint32_t counts[AGE_BUCKETS];
+    };
+
+    // A region of the pool, the size of a failed request, which is partly in use.
+    struct BlameRegion
+    {
+        const void* base;
+        uint32_t    used_bytes;
+    };
+
+    // A live allocation which stops a region from coalescing. The age is only 
+    // meaningful if aged is true (see BuddyTraits::AGES), and the tag is zero if 
+    // tagging is disabled.
+    struct Blocker
+    {
+        const void* pointer;
+        uint32_t    bytes;
+        uint16_t    tag;
+        bool        aged;
+        uint32_t    age;
+    };
+
+    // Offsets into the pool, for compact references: see alloc_offset(). This is the 
+    // smallest unsigned type which can hold any offset, plus a null value.
+    using Offset = std::conditional_t<(MAX_ORDER <= 8), uint8_t, 
+                   std::conditional_t<(MAX_ORDER <= 16), uint16_t, uint32_t>>;
+    // Never a valid offset, since blocks are at least two bytes and aligned.
+    static constexpr Offset NULL_OFFSET = std::numeric_limits<Offset>::max();
+
+    // Stored in place of the order for the members of a cluster. Not a valid order.
+    static constexpr uint8_t CLUSTER_MEMBER = 0xFF;
+
+    // Where the bytes of a BuddyAllocator go, as returned by footprint(). The empty 
+    // arrays of disabled features still take a byte or so each. Slack is the padding 
+    // between members, mostly to align the pool. Each allocation also costs a byte of 
+    // the pool for its order, and the rounding up to a power of two.
+    struct Footprint
+    {
+        size_t pool;
+        size_t freelists;
+        size_t caps;
+        size_t stats;
+        size_t metadata;
+        size_t profiler;
+        size_t stash;
+        size_t dummy;
+        size_t slack;
+        size_t total;
+    };
+
+    // The most nearly free regions considered by blame().
+    static constexpr uint8_t MAX_BLAME_REGIONS = 8;
+
     BuddyAllocator()
     {
         // The base state is a single large block which will be sub-divided as
         // allocations are made.
         m_freelists[MAX_ORDER - MIN_ORDER] = &m_buffer[0];
+        *reinterpret_cast<uint8_t**>(&m_buffer[0]) = nullptr;
+        if constexpr (STATS)
+        {
+            m_stats.orders[MAX_ORDER - MIN_ORDER].free_blocks.store(1, std::memory_order_relaxed);
+            m_stats.free_bytes.store(1U << MAX_ORDER, std::memory_order_relaxed);
+        }
+
+        // Each order is initially a band of its own, with no cap.
+        for (uint8_t i = 0; i < ORDERS; ++i)
+        {
+            m_band_of[i]  = i;
+            m_band_cap[i] = UINT32_MAX;
+        }
+
+        if constexpr (SAMPLED)
+        {
+            m_sample_countdown = next_sample_interval();
+        }
+
+        for (auto& stash: m_stashes)
+        {
+            stash.batch  = TRAITS::STASH_BATCH;
+            stash.weight = STASH_WEIGHT;
+        }
+    }
+
+    ~BuddyAllocator()
+    {
+        if constexpr (LAZY_META)
+        {
+            for (MetaChunk* chunk: m_meta_chunks)
+            {
+                if (chunk != nullptr)
+                {
+                    TRAITS::free_metadata(chunk);
+                }
+            }
+        }
+    }
+
+    // Takes a snapshot of the counters without blocking alloc() or free(). The counters 
+    // are published through a seqlock: if an update is in progress, or one happens while 
+    // we are copying, we simply try again. Safe to call from any thread, but alloc() and 
+    // free() must still be serialised by the caller as before.
+    Stats read_stats() const
+    {
+        static_assert(STATS, "Stats are disabled: see BuddyTraits::STATS");
+        Stats result;
+        read_consistent([&]
+        {
+            for (uint8_t i = 0; i < ORDERS; ++i)
+            {
+                result.orders[i].allocs      = m_stats.orders[i].allocs.load(std::memory_order_relaxed);
+                result.orders[i].frees       = m_stats.orders[i].frees.load(std::memory_order_relaxed);
+                result.orders[i].free_blocks = m_stats.orders[i].free_blocks.load(std::memory_order_relaxed);
+                result.orders[i].capped      = m_stats.orders[i].capped.load(std::memory_order_relaxed);
+            }
+            result.used_bytes = m_stats.used_bytes.load(std::memory_order_relaxed);
+            result.free_bytes = m_stats.free_bytes.load(std::memory_order_relaxed);
+            result.failures   = m_stats.failures.load(std::memory_order_relaxed);
+        });
+        return result;
+    }
+
+    // As read_stats(), for the blocks currently allocated with the given tag. Bytes are 
+    // counted as whole blocks, since that is what the pool gives up for them.
+    TagStats read_tag_stats(uint32_t tag) const
+    {
+        static_assert(MAX_TAGS > 0, "Tagging is disabled: see BuddyTraits::MAX_TAGS");
+        tag %= MAX_TAGS;
+
+        TagStats result;
+        read_consistent([&]
+        {
+            result.live_bytes = m_tag_stats[tag].live_bytes.load(std::memory_order_relaxed);
+            result.live_count = m_tag_stats[tag].live_count.load(std::memory_order_relaxed);
+        });
+        return result;
+    }
+
+    // Lifetimes of freed allocations of the given order, read in the same way as 
+    // read_stats(). Only allocations with a recorded time are counted: see BuddyTraits::AGES.
+    AgeHistogram read_lifetimes_by_order(uint8_t order) const
+    {
+        static_assert(AGED, "Ages are disabled: see BuddyTraits::AGES");
+        AgeHistogram result;
+        read_consistent([&]
+        {
+            copy_histogram(m_order_lifetimes[order - MIN_ORDER], result);
+        });
+        return result;
+    }
+
+    // As read_lifetimes_by_order(), for the allocations with the given tag.
+    AgeHistogram read_lifetimes_by_tag(uint32_t tag) const
+    {
+        static_assert(AGED && TAGGED, "Ages or tags are disabled: see BuddyTraits");
+        AgeHistogram result;
+        read_consistent([&]
+        {
+            copy_histogram(m_tag_lifetimes[tag % MAX_TAGS], result);
+        });
+        return result;
+    }
+
+    // Calls f(void* block, uint32_t size) for each block in the free lists, largest 
+    // first, e.g. to give unused pages back to the OS. The first bytes of each block hold
+    // the free list, and the last byte holds the order of the next block, so neither may
+    // be changed. Blocks held in stashes are left out, as they will soon be used again.
+    // Must be serialised with alloc() and free(), and f must not use the pool.
+    template <typename F>
+    void for_each_free(F f) const
+    {
+        for (uint8_t order = MAX_ORDER + 1; order-- > MIN_ORDER; )
+        {
+            for (uint8_t* block = m_freelists[order - MIN_ORDER]; block != nullptr; 
+                 block = *reinterpret_cast<uint8_t**>(block))
+            {
+                f(static_cast<void*>(block), 1U << order);
+            }
+        }
+    }
+
+    // Calls f(order, tag, age) for each live allocation with a recorded time, so that 
+    // the blocks which have been held a long time can be found. Tag is zero if tagging 
+    // is disabled. Walks the whole of the metadata, so is not cheap, and must be 
+    // serialised with alloc() and free().
+    template <typename F>
+    void for_each_live_age(F f) const
+    {
+        static_assert(AGED, "Ages are disabled: see BuddyTraits::AGES");
+        uint32_t time = TRAITS::now();
+        for_each_live_meta(0, BLOCKS, [&](uint32_t i, const Meta& meta)
+        {
+            if (has_birth(meta))
+            {
+                f(meta.order, meta.tag, time - birth_of(i, meta));
+            }
+        });
+    }
+
+    // Explains why a request for size bytes fails (or would fail) even though there may
+    // be enough free memory in total. Finds the regions of the size needed which have 
+    // the fewest bytes in use, up to max_regions of them, most nearly free first, and 
+    // calls f(const BlameRegion&, const Blocker&) for each live allocation in them. These 
+    // are the allocations which, if they were made from another pool, would have let 
+    // the request succeed. Needs the order of every live allocation, which is only kept
+    // with tags or full ages. Walks the whole of the metadata, and must be serialised 
+    // with alloc() and free(). See BuddyProfile.h for a printable report.
+    template <typename F>
+    void blame(uint32_t size, uint8_t max_regions, F f) const
+    {
+        static_assert(ORDERED, "Blame needs tags or full ages: see BuddyTraits");
+
+        uint8_t order = std::max(MIN_ORDER, log2(size + 1));
+        if ((size == 0) || (order > MAX_ORDER))
+        {
+            return;
+        }
+        max_regions = std::min(max_regions, MAX_BLAME_REGIONS);
+
+        // Keep the most nearly free regions, sorted by bytes in use. Regions which are
+        // entirely free would satisfy the request, so are not interesting.
+        BlameRegion nearest[MAX_BLAME_REGIONS];
+        uint8_t     count  = 0;
+        uint32_t    blocks = 1U << (order - MIN_ORDER);
+        for (uint32_t first = 0; first < BLOCKS; first += blocks)
+        {
+            uint32_t used = region_used_bytes(first, order);
+            if ((used == 0) || ((count == max_regions) && (used >= nearest[count - 1].used_bytes)))
+            {
+                continue;
+            }
+
+            uint8_t i = (count < max_regions) ? count++ : (count - 1);
+            while ((i > 0) && (nearest[i - 1].used_bytes > used))
+            {
+                nearest[i] = nearest[i - 1];
+                --i;
+            }
+            nearest[i] = BlameRegion{&m_buffer[first << MIN_ORDER], used};
+        }
+
+        uint32_t time = AGED ? TRAITS::now() : 0;
+        for (uint8_t r = 0; r < count; ++r)
+        {
+            uint32_t first = index_of(static_cast<const uint8_t*>(nearest[r].base));
+            for_each_live_meta(first, blocks, [&](uint32_t i, const Meta& meta)
+            {
+                Blocker blocker{&m_buffer[i << MIN_ORDER], 1U << meta.order, meta.tag, false, 0};
+                if constexpr (AGED)
+                {
+                    blocker.aged = has_birth(meta);
+                    blocker.age  = blocker.aged ? (time - birth_of(i, meta)) : 0;
+                }
+                f(nearest[r], blocker);
+            });
+        }
+    }
+
+    // The histogram bucket for an age.
+    static constexpr uint8_t age_bucket(uint32_t age)
+    {
+        uint8_t bucket = 0;
+        while ((age != 0) && (bucket < (AGE_BUCKETS - 1)))
+        {
+            age >>= 1;
+            ++bucket;
+        }
+        return bucket;
+    }
+
+    // Calls f(const SampledStack&) for each stack recorded by the heap profiler. Unlike
+    // read_stats(), this must be serialised with alloc() and free(). See BuddyProfile.h
+    // for writing the samples as a profile.
+    template <typename F>
+    void for_each_sampled_stack(F f) const
+    {
+        static_assert(SAMPLED, "Sampling is disabled: see BuddyTraits::SAMPLE_INTERVAL");
+        for (uint16_t i = 0; i < m_stack_count; ++i)
+        {
+            f(m_stacks[i]);
+        }
+    }
+
+    // The exact memory cost of this configuration: see Footprint.
+    static constexpr Footprint footprint()
+    {
+        Footprint result{};
+        result.pool      = sizeof(m_buffer);
+        result.freelists = sizeof(m_freelists);
+        result.caps      = sizeof(m_band_of) + sizeof(m_band_used) + sizeof(m_band_cap);
+        result.stats     = sizeof(m_stats) + sizeof(m_stats_seq) + sizeof(m_tag_stats) + 
+                           sizeof(m_order_lifetimes) + sizeof(m_tag_lifetimes);
+        result.metadata  = sizeof(m_meta) + sizeof(m_births) + sizeof(m_meta_chunks) + 
+                           sizeof(m_meta_chunk_count) + sizeof(m_adopted);
+        result.profiler  = sizeof(m_stacks) + sizeof(m_samples) + sizeof(m_sample_births) + sizeof(m_stack_count) +
+                           sizeof(m_free_sample) + sizeof(m_sample_countdown) + sizeof(m_sample_random);
+        result.stash     = sizeof(m_stashes) + sizeof(m_stash_countdown);
+        result.dummy     = sizeof(m_dummy);
+        result.total     = sizeof(BuddyAllocator);
+        result.slack     = result.total - result.pool - result.freelists - result.caps - result.stats - 
+                           result.metadata - result.profiler - result.stash - result.dummy;
+        return result;
+    }
+
+    // Bytes of metadata allocated so far for regions in use, when the metadata is 
+    // allocated lazily (see BuddyTraits::META_CHUNK_ORDER). This is in addition to the 
+    // footprint.
+    size_t lazy_metadata_bytes() const
+    {
+        return size_t{m_meta_chunk_count} * sizeof(MetaChunk);
+    }
+
+    // The order of the block which alloc() uses for size bytes, allowing one byte for
+    // metadata. May be more than MAX_ORDER, in which case alloc() fails.
+    static constexpr uint8_t order_of(uint32_t size)
+    {
+        return std::max(MIN_ORDER, log2(size + 1));
+    }
+
+    // Returns every block held in the stashes to the free lists, where they coalesce as
+    // usual. Returns false if the stashes were already empty. The stashes keep their 
+    // sizes, and refill as they are used. Useful before looking for leaks, or before 
+    // blame(), which counts stashed blocks as free.
+    bool flush_stashes()
+    {
+        bool flushed = false;
+        if constexpr (STASHED)
+        {
+            stats_begin();
+            for (uint8_t i = 0; i < ORDERS; ++i)
+            {
+                flushed = flushed || (m_stashes[i].count > 0);
+                shrink_stash(MIN_ORDER + i, 0);
+            }
+            stats_end();
+        }
+        return flushed;
+    }
+
+    // Ends the current stash period early and retunes the stashes, as if no more blocks
+    // had been asked for. Retuning otherwise only happens in alloc(), so a pool which has 
+    // gone idle would keep its stashes until it was used again. Calling this from a timer
+    // or idle hook lets them decay: stashed blocks not used since the previous retune go
+    // back to the pool at once, and the targets shrink as the demand decays. Must be
+    // serialised with alloc() and free().
+    void decay_stashes()
+    {
+        if constexpr (STASHED)
+        {
+            m_stash_countdown = TRAITS::STASH_PERIOD;
+            retune_stashes();
+        }
+    }
+
+    // The state of the stash for one order, as returned by read_stash().
+    struct StashInfo
+    {
+        uint8_t count;
+        uint8_t target;
+        uint8_t batch;
+    };
+
+    // The blocks held in the stash for order, the most it may hold, and the number of 
+    // blocks it is refilled with. All zero if stashes are disabled. Must be serialised 
+    // with alloc() and free().
+    StashInfo read_stash(uint8_t order) const
+    {
+        if constexpr (STASHED)
+        {
+            const Stash& stash = m_stashes[order - MIN_ORDER];
+            return StashInfo{stash.count, stash.target, stash.batch};
+        }
+        return StashInfo{};
+    }
+
+    // The bytes held in stashes. Stashed blocks are counted as free blocks in the stats.
+    // Must be serialised with alloc() and free().
+    uint32_t stashed_bytes() const
+    {
+        uint32_t bytes = 0;
+        if constexpr (STASHED)
+        {
+            for (uint8_t i = 0; i < ORDERS; ++i)
+            {
+                bytes += uint32_t(m_stashes[i].count) << (MIN_ORDER + i);
+            }
+        }
+        return bytes;
+    }
+
+    // Limits the bytes which may be held in allocations of the orders first to last 
+    // (inclusive) taken together, so that, for example, a flood of small allocations 
+    // cannot splinter every large block and starve large requests. Requests over the cap 
+    // fail, and are counted in the stats. The orders form a band which replaces any 
+    // band they were in before: orders left behind keep their old cap. UINT32_MAX removes 
+    // the cap. Allocations already made count towards the cap but are not affected. 
+    // Needs the stats, from which the bytes in each band are worked out.
+    void set_occupancy_cap(uint8_t first, uint8_t last, uint32_t max_bytes)
+    {
+        static_assert(STATS, "Occupancy caps need the stats: see BuddyTraits::STATS");
+        first = std::max(first, MIN_ORDER);
+        last  = std::min(last, MAX_ORDER);
+        if (first > last)
+        {
+            return;
+        }
+
+        // Bands are identified by the index of an order. The new band takes the index of
+        // its first order, so any other orders in a band with that index need a new one. 
+        uint8_t band  = first - MIN_ORDER;
+        uint8_t moved = ORDERS;
+        for (uint8_t i = 0; i < ORDERS; ++i)
+        {
+            if ((m_band_of[i] == band) && ((i < band) || (i > (last - MIN_ORDER))))
+            {
+                moved = std::min(moved, i);
+                m_band_of[i] = moved;
+            }
+        }
+        if (moved < ORDERS)
+        {
+            m_band_cap[moved] = m_band_cap[band];
+        }
+
+        for (uint8_t i = band; i <= (last - MIN_ORDER); ++i)
+        {
+            m_band_of[i] = band;
+        }
+        m_band_cap[band] = max_bytes;
+
+        // Recalculate usage from the stats, as bands may have been rearranged.
+        std::fill(std::begin(m_band_used), std::end(m_band_used), 0);
+        for (uint8_t i = 0; i < ORDERS; ++i)
+        {
+            uint32_t live = m_stats.orders[i].allocs.load(std::memory_order_relaxed) - 
+                            m_stats.orders[i].frees.load(std::memory_order_relaxed);
+            m_band_used[m_band_of[i]] += live << (MIN_ORDER + i);
+        }
     }
 
     // Returns a block with size the smallest power of two which will hold the 
     // request. Internally allocates size + 1, with the extra byte used to store 
     // the order - the power of two that was needed - to help with free().
-    void* alloc(uint32_t size)
+    // The tag is only used if tagging is enabled in the TRAITS. It is reduced modulo
+    // MAX_TAGS, so a hash such as site_tag() can be passed directly.
+    void* alloc(uint32_t size, uint32_t tag = 0)
     {
-        // Find the power of 2 needed to satisfy the request. Add one for metadata.
-        uint8_t order = std::max(MIN_ORDER, log2(size + 1));
+        // Find the power of 2 needed to satisfy the request.
+        uint8_t order = order_of(size);
 
         // Confirm the request is not too large.
         if ((size == 0) || (order > MAX_ORDER))
         { 
+            count_failure();
+            return nullptr;
+        }
+
+        // Confirm the request is within the occupancy cap.
+        if (over_cap(order))
+        {
+            count_capped(order);
             return nullptr;
         }
+
+        // A hot order is served from its stash without searching or splitting.
+        if constexpr (STASHED)
+        {
+            if (uint8_t* block = unstash(order))
+            {
+                stats_begin();
+                if constexpr (STATS)
+                {
+                    bump(m_stats.orders[order - MIN_ORDER].free_blocks, -1);
+                }
+                return hand_out(block, order, tag);
+            }
+        }
   
         // Find the first free block we can use, it may be larger than we need.
         uint8_t* block = m_freelists[order - MIN_ORDER];
@@ -95,87 +752,1666 @@ public:
             block = m_freelists[index - MIN_ORDER];
         }
 
-        // Confirm the request can be satisfied.
+        // Confirm the request can be satisfied. The stashes might hold buddies of free 
+        // blocks which would coalesce into one big enough.
         if (block == nullptr)
         {
+            if constexpr (STASHED)
+            {
+                if (flush_stashes())
+                {
+                    return alloc(size, tag);
+                }
+            }
+            count_failure();
             return nullptr;
         }
 
-        // Store any buddies in the relevant free lists. 
-        m_freelists[index - MIN_ORDER] = *reinterpret_cast<uint8_t**>(block);
-        while (index > order)
+        // Large blocks come from as high in the pool as possible, whatever the order.
+        if constexpr (TWO_ENDED)
         {
-            --index;
-            uint8_t* buddy = buddy_of(block, index);
-            // Equivalent to having a linked list of struct Pointer { Pointer* next; }; 
-            *reinterpret_cast<uint8_t**>(buddy) = m_freelists[index - MIN_ORDER];
-            m_freelists[index - MIN_ORDER] = buddy;
+            if (order >= TRAITS::LARGE_ORDER)
+            {
+                index = highest_order(index);
+            }
         }
 
-        // Store the order so that we know how to free this pointer later.
-        *(block - 1) = order;
-        return block;
+        return take(order, index, tag);
     }
 
-    void free(void* pointer)
+    // Best effort allocation, for callers which can make do with less than they would 
+    // like. Returns the largest block available which will hold at least min_size bytes,
+    // but no bigger than needed for max_size, and sets size to the number of bytes it
+    // can actually hold. A free block which needs no splitting is always preferred, so 
+    // a large block is only split if there is nothing between min_size and max_size.
+    void* alloc_range(uint32_t min_size, uint32_t max_size, uint32_t& size, uint32_t tag = 0)
     {
-        if (pointer == nullptr)
-        {
-            return;
+        size = 0;
+        if ((min_size == 0) || (min_size > max_size) || (min_size > LARGEST_SIZE))
+        { 
+            count_failure();
+            return nullptr;
         }
 
-        uint8_t* block = static_cast<uint8_t*>(pointer);
-
-        // Retrieve the order - indicates the size of the allocation.
-        uint8_t order = *(block - 1);
+        // Clamped first, as sizes near UINT32_MAX would overflow log2().
+        max_size = std::min(max_size, LARGEST_SIZE);
+        uint8_t lower = order_of(min_size);
+        uint8_t upper = order_of(max_size);
 
-        while (true)
+        // Largest first, without splitting.
+        bool capped = false;
+        for (uint8_t order = upper + 1; order-- > lower; )
         {
-            // Is the buddy block already free?
-            uint8_t* buddy = buddy_of(block, order);            
-            // Use a pointer to pointer so we can modify the value later.
-            uint8_t** ptr = &m_freelists[order - MIN_ORDER];
-            while ((*ptr != nullptr) && (*ptr != buddy))
+            capped = capped || over_cap(order);
+            if ((m_freelists[order - MIN_ORDER] != nullptr) && !over_cap(order))
             {
-                ptr = reinterpret_cast<uint8_t**>(*ptr);
+                void* block = take(order, order, tag);
+                size = (block != nullptr) ? (1U << order) - 1 : 0;
+                return block;
             }
+        }
 
-            // If the buddy was not found in the free list we are done.
-            if (*ptr == nullptr)
+        // Otherwise split the smallest block which is larger than needed.
+        while ((upper >= lower) && over_cap(upper))
+        {
+            --upper;
+        }
+        for (uint8_t index = upper + 1; (upper >= lower) && (index <= MAX_ORDER); ++index)
+        {
+            if (m_freelists[index - MIN_ORDER] != nullptr)
             {
-                // Equivalent to having a linked list of struct Pointer { Pointer* next; }; 
-                *reinterpret_cast<uint8_t**>(block) = m_freelists[order - MIN_ORDER];
-                m_freelists[order - MIN_ORDER] = block;
-                return;
+                void* block = take(upper, index, tag);
+                size = (block != nullptr) ? (1U << upper) - 1 : 0;
+                return block;
             }
+        }
 
-            // The buddy was found in the free list. We will coalesce.
-            // Remove the buddy from the free list by assigning the next item in the list.
-            *ptr = *reinterpret_cast<uint8_t**>(*ptr);
-
-            // Take the lower address of the block and its buddy for adding into the 
-            // next free list.
-            block = std::min(block, buddy);
-            ++order;
+        if (capped)
+        {
+            count_capped(lower);
+        }
+        else
+        {
+            count_failure();
         }
+        return nullptr;
     }
 
-private:
-    uint8_t* buddy_of(uint8_t* ptr, uint8_t order)
+    // Turns a live allocation into two allocations of half the size, which can then be
+    // freed (or split) independently. The pointer remains valid for the first half, and 
+    // the second half is returned. Like any allocation, each half loses a byte to the 
+    // order of the block which follows it, so the last byte of the first half now holds 
+    // the order of the second half and must no longer be used. Returns nullptr if the 
+    // allocation is already the minimum size, or is part of a cluster. The second half 
+    // inherits the tag and age.
+    void* split(void* pointer)
     {
-        uint32_t size = 1U << order;
-        uint8_t* base = &m_buffer[0];
+        uint8_t* block = static_cast<uint8_t*>(pointer);
+        uint8_t  order = *(block - 1);
+        if ((order == CLUSTER_MEMBER) || (order <= MIN_ORDER))
+        {
+            return nullptr;
+        }
+
+        --order;
+        uint8_t* second = block + (1U << order);
+        if constexpr (LAZY_META)
+        {
+            if (!ensure_metadata(second))
+            {
+                return nullptr;
+            }
+        }
+
+        // Counted as freeing the original and allocating the halves, so that live blocks 
+        // per order remain allocs - frees.
+        stats_begin();
+        if constexpr (STATS)
+        {
+            bump(m_stats.orders[order + 1 - MIN_ORDER].frees, 1);
+            bump(m_stats.orders[order - MIN_ORDER].allocs, 2);
+        }
+        charge(order + 1, -(2 << order));
+        charge(order, 2 << order);
+        if constexpr (ORDERED)
+        {
+            Meta& meta = meta_of(block);
+            meta.order = order;
+            meta_of(second) = Meta{meta.tag, 0, order};
+        }
+        else if constexpr (TRACKED)
+        {
+            if (meta_of(block).sample != 0)
+            {
+                meta_of(block).order = order;
+            }
+        }
+        if constexpr (TAGGED)
+        {
+            bump(m_tag_stats[meta_of(block).tag].live_count, 1);
+        }
+        if constexpr (TRAITS::AGES == TRAITS::Ages::Full)
+        {
+            birth_at(index_of(second)) = birth_at(index_of(block));
+        }
+        stats_end();
+
+        // A sample stays with the first half, which is now smaller.
+        if constexpr (SAMPLED)
+        {
+            if (meta_of(block).sample != 0)
+            {
+                m_stacks[m_samples[meta_of(block).sample - 1]].live_bytes -= 1U << order;
+            }
+        }
+
+        *(block - 1)  = order;
+        *(second - 1) = order;
+        return second;
+    }
+
+    // The reverse of split(): combines two live allocations which are buddies (of the 
+    // same size, and adjacent within the next size up) into one. Either order of the
+    // arguments will do. Returns the combined allocation, which has the lower address, 
+    // or nullptr if the allocations are not buddies. The combined allocation keeps the 
+    // tag and age of the lower half.
+    void* join(void* a, void* b)
+    {
+        uint8_t* lower = static_cast<uint8_t*>(std::min(a, b));
+        uint8_t* upper = static_cast<uint8_t*>(std::max(a, b));
+        uint8_t  order = *(lower - 1);
+        if ((order >= MAX_ORDER) || (*(upper - 1) != order) || (buddy_of(lower, order) != upper))
+        {
+            return nullptr;
+        }
+
+        stats_begin();
+        if constexpr (STATS)
+        {
+            bump(m_stats.orders[order - MIN_ORDER].frees, 2);
+            bump(m_stats.orders[order + 1 - MIN_ORDER].allocs, 1);
+        }
+        charge(order, -(2 << order));
+        charge(order + 1, 2 << order);
+        if constexpr (TAGGED)
+        {
+            uint16_t lower_tag = meta_of(lower).tag;
+            uint16_t upper_tag = meta_of(upper).tag;
+            bump(m_tag_stats[upper_tag].live_bytes, -(1 << order));
+            bump(m_tag_stats[upper_tag].live_count, -1);
+            bump(m_tag_stats[lower_tag].live_bytes, 1 << order);
+        }
+        stats_end();
+
+        if constexpr (SAMPLED)
+        {
+            if (meta_of(upper).sample != 0)
+            {
+                unsample(upper, order);
+            }
+            if (meta_of(lower).sample != 0)
+            {
+                m_stacks[m_samples[meta_of(lower).sample - 1]].live_bytes += 1U << order;
+            }
+        }
+        if constexpr (ORDERED)
+        {
+            meta_of(upper).order = 0;
+            meta_of(lower).order = order + 1;
+        }
+        else if constexpr (TRACKED)
+        {
+            if (meta_of(lower).sample != 0)
+            {
+                meta_of(lower).order = order + 1;
+            }
+        }
+
+        *(lower - 1) = order + 1;
+        return lower;
+    }
+
+    // The number of bytes an allocation can hold, which may be more than was requested.
+    // Not valid for cluster members.
+    uint32_t capacity(const void* pointer) const
+    {
+        return (1U << *(static_cast<const uint8_t*>(pointer) - 1)) - 1;
+    }
+
+    // As std::realloc(): resizes an allocation, moving it if necessary, and returns the
+    // new pointer. A null pointer is allocated, and a size of zero frees. If the request
+    // cannot be satisfied, returns nullptr and leaves the original allocation alone.
+    // Shrinking happens in place, by splitting off and freeing the unwanted halves.
+    // Growing to a larger order always moves: a new block is allocated with the same
+    // tag, the contents are copied, and the original is freed. Cluster members cannot
+    // be resized.
+    void* realloc(void* pointer, uint32_t size)
+    {
+        return realloc(pointer, size, [](void* to, const void* from, uint32_t bytes)
+        {
+            std::memcpy(to, from, bytes);
+        });
+    }
+
+    // As above, but the contents are moved with move(to, from, bytes) rather than memcpy,
+    // so that a caller who owns the underlying memory can move pages rather than bytes.
+    // The blocks do not overlap.
+    template <typename MOVE>
+    void* realloc(void* pointer, uint32_t size, MOVE move)
+    {
+        if (pointer == nullptr)
+        {
+            return alloc(size);
+        }
+        if (size == 0)
+        {
+            free(pointer);
+            return nullptr;
+        }
+
+        uint8_t* block = static_cast<uint8_t*>(pointer);
+        uint8_t  order = *(block - 1);
+        uint8_t  fit   = std::max(MIN_ORDER, log2(size + 1));
+        if ((order == CLUSTER_MEMBER) || (fit > MAX_ORDER))
+        {
+            count_failure();
+            return nullptr;
+        }
+
+        // If a split fails, the block is simply left larger than it needs to be.
+        while (order > fit)
+        {
+            void* second = split(block);
+            if (second == nullptr)
+            {
+                break;
+            }
+            free(second);
+            --order;
+        }
+        if (order >= fit)
+        {
+            return block;
+        }
+
+        uint32_t tag = 0;
+        if constexpr (TAGGED)
+        {
+            tag = meta_of(block).tag;
+        }
+        void* result = alloc(size, tag);
+        if (result != nullptr)
+        {
+            move(result, block, capacity(block));
+            free(block);
+        }
+        return result;
+    }
+
+    // As alloc(), but returns the block's offset from the start of the pool, or NULL_OFFSET 
+    // if the request cannot be satisfied. Offsets are half the size of pointers or less, 
+    // which matters for data structures holding very many references to each other.
+    Offset alloc_offset(uint32_t size, uint32_t tag = 0)
+    {
+        void* pointer = alloc(size, tag);
+        return (pointer != nullptr) ? offset_from_ptr(pointer) : NULL_OFFSET;
+    }
+
+    // As free(), for an offset returned by alloc_offset(). Ignores NULL_OFFSET.
+    void free_offset(Offset offset)
+    {
+        if (offset != NULL_OFFSET)
+        {
+            free(&m_buffer[offset]);
+        }
+    }
+
+    // True if the pointer lies within the pool. Used to route free() between pools.
+    bool contains(const void* pointer) const
+    {
+        auto p = static_cast<const uint8_t*>(pointer);
+        return (p >= &m_buffer[0]) && (p < (&m_buffer[0] + sizeof(m_buffer)));
+    }
+
+    // Converts between offsets and pointers. Any pointer into the pool can be converted, 
+    // not only those made by alloc_offset(). These are just arithmetic: NULL_OFFSET and 
+    // nullptr are not valid arguments.
+    void* ptr_from_offset(Offset offset)
+    {
+        return &m_buffer[offset];
+    }
+
+    const void* ptr_from_offset(Offset offset) const
+    {
+        return &m_buffer[offset];
+    }
+
+    Offset offset_from_ptr(const void* pointer) const
+    {
+        return static_cast<Offset>(static_cast<const uint8_t*>(pointer) - &m_buffer[0]);
+    }
+
+    // Allocates several objects together from a single block, so that objects which are 
+    // used together share cache lines, and the pool is only searched once. Each object 
+    // is aligned to ALIGNMENT. Returns the objects' pointers in the same order as the 
+    // sizes, or all nullptr if the block could not be allocated.
+    //
+    // The objects can be passed to free() individually, and the block returns to the 
+    // pool when the last one is freed. Or free_cluster() releases them all at once. 
+    // Each object costs a small header: the block starts with a count of live objects, 
+    // and each object is preceded by the distance back to the start of the block and a
+    // marker in place of the order.
+    template <size_t N>
+    std::array<void*, N> alloc_cluster(const uint32_t (&sizes)[N], uint32_t tag = 0)
+    {
+        static_assert(N > 0);
+
+        uint32_t offsets[N];
+        uint32_t total = sizeof(uint32_t);
+        for (size_t i = 0; i < N; ++i)
+        {
+            total += sizeof(uint32_t) + 1;
+            total  = (total + ALIGNMENT - 1) & ~uint32_t(ALIGNMENT - 1);
+            // Stop before the sum can wrap: a cluster larger than the pool fails anyway.
+            if ((total > (1U << MAX_ORDER)) || (sizes[i] > ((1U << MAX_ORDER) - total)))
+            {
+                count_failure();
+                return {};
+            }
+            offsets[i] = total;
+            total += sizes[i];
+        }
+
+        std::array<void*, N> result{};
+        uint8_t* block = static_cast<uint8_t*>(alloc(total, tag));
+        if (block == nullptr)
+        {
+            return result;
+        }
+
+        *reinterpret_cast<uint32_t*>(block) = N;
+        for (size_t i = 0; i < N; ++i)
+        {
+            uint8_t* member = block + offsets[i];
+            std::memcpy(member - sizeof(uint32_t) - 1, &offsets[i], sizeof(uint32_t));
+            *(member - 1) = CLUSTER_MEMBER;
+            result[i] = member;
+        }
+        return result;
+    }
+
+    // Detaches the block of the given order which contains pointer from the pool, along 
+    // with the live allocations within it, so that another allocator can adopt() them. 
+    // For example, a worker can hand all of a request's data to another thread at once,
+    // and the other thread's allocator then takes the frees. The block must have been 
+    // split, directly or not, rather than be part of a larger allocation. This is the 
+    // case when the block has been used for many small allocations. Returns an empty
+    // subtree if the block is free or is part of a larger free block, or the live 
+    // allocations within it don't fit exactly. The allocations count as freed here, and
+    // the block is no longer part of the pool until it is given back with attach(). 
+    // Walks the free lists, so is not cheap.
+    BuddySubtree detach(const void* pointer, uint8_t order)
+    {
+        static_assert(!TRACKED, "Subtrees cannot be moved with tags, sampling or ages");
+        if constexpr (STASHED)
+        {
+            flush_stashes();
+        }
+
+        if ((order < MIN_ORDER) || (order > MAX_ORDER) || !contains(pointer))
+        {
+            return {};
+        }
+        uint32_t size = 1U << order;
+        uint8_t* base = &m_buffer[offset_from_ptr(pointer) & ~(size - 1)];
+        uint8_t* end  = base + size;
+
+        // The block must not be free, or be within a free block.
+        for (uint8_t index = order; index <= MAX_ORDER; ++index)
+        {
+            for (uint8_t* block = m_freelists[index - MIN_ORDER]; block != nullptr; 
+                 block = *reinterpret_cast<uint8_t**>(block))
+            {
+                if ((block <= base) && (base < (block + (1U << index))))
+                {
+                    return {};
+                }
+            }
+        }
+
+        // Nor be within a larger allocation, whose data could look like orders to the
+        // walk below. The byte before each enclosing block holds its order if it is live,
+        // and can be trusted from the top down, as a live block above would already have
+        // been found. A stale byte in front of a split block may refuse a subtree which
+        // could have been moved, but never the reverse.
+        for (uint8_t index = MAX_ORDER; index > order; --index)
+        {
+            uint8_t* enclosing = &m_buffer[offset_from_ptr(pointer) & ~((1U << index) - 1)];
+            if (*(enclosing - 1) >= index)
+            {
+                return {};
+            }
+        }
+
+        // Take the free blocks within it out of the free lists, and chain them in address 
+        // order.
+        BuddySubtree subtree{base, order, nullptr};
+        stats_begin();
+        for (uint8_t index = MIN_ORDER; index < order; ++index)
+        {
+            uint8_t** ptr = &m_freelists[index - MIN_ORDER];
+            while (*ptr != nullptr)
+            {
+                uint8_t* block = *ptr;
+                if ((block < base) || (block >= end))
+                {
+                    ptr = reinterpret_cast<uint8_t**>(block);
+                    continue;
+                }
+                *ptr = *reinterpret_cast<uint8_t**>(block);
+                if constexpr (STATS)
+                {
+                    bump(m_stats.orders[index - MIN_ORDER].free_blocks, -1);
+                }
+
+                uint8_t** at = &subtree.free_blocks;
+                while ((*at != nullptr) && (*at < block))
+                {
+                    at = reinterpret_cast<uint8_t**>(*at);
+                }
+                *reinterpret_cast<uint8_t**>(block) = *at;
+                block[sizeof(uint8_t*)] = index;
+                *at = block;
+            }
+        }
+
+        // If the blocks don't tile the subtree, it was part of a larger allocation. 
+        bool tiled = walk_subtree(subtree, [](uint8_t*, uint8_t, bool) {});
+        for (uint8_t* block = subtree.free_blocks; !tiled && (block != nullptr); )
+        {
+            uint8_t* next = *reinterpret_cast<uint8_t**>(block);
+            push_free(block, block[sizeof(uint8_t*)]);
+            block = next;
+        }
+        if (!tiled)
+        {
+            stats_end();
+            return {};
+        }
+
+        walk_subtree(subtree, [this](uint8_t*, uint8_t index, bool free)
+        {
+            if (free)
+            {
+                if constexpr (STATS)
+                {
+                    bump(m_stats.free_bytes, -(1 << index));
+                }
+            }
+            else
+            {
+                if constexpr (STATS)
+                {
+                    bump(m_stats.orders[index - MIN_ORDER].frees, 1);
+                    bump(m_stats.used_bytes, -(1 << index));
+                }
+                charge(index, -(1 << index));
+            }
+        });
+        stats_end();
+        return subtree;
+    }
+
+    // Takes over a subtree detached from another allocator with the same MIN_ORDER. The 
+    // subtree's allocations can then be passed to free() here, though they are outside 
+    // the pool, and count as allocations of this allocator. Their space is not reused 
+    // for new allocations. Once all of them have been freed, release() hands the block 
+    // back, to be returned to its own allocator with attach(). Returns false if 
+    // MAX_ADOPTED subtrees are already held.
+    bool adopt(const BuddySubtree& subtree)
+    {
+        static_assert(ADOPTING, "Adoption needs MAX_ADOPTED in the traits");
+        static_assert(!TRACKED, "Subtrees cannot be moved with tags, sampling or ages");
+        if (!subtree || (subtree.order > MAX_ORDER))
+        {
+            return false;
+        }
+
+        for (auto& adopted: m_adopted)
+        {
+            if (adopted.base != nullptr)
+            {
+                continue;
+            }
+
+            adopted = Adopted{subtree.base, subtree.order, {}};
+            stats_begin();
+            walk_subtree(subtree, [&](uint8_t* block, uint8_t index, bool free)
+            {
+                if (free)
+                {
+                    *reinterpret_cast<uint8_t**>(block) = adopted.freelists[index - MIN_ORDER];
+                    adopted.freelists[index - MIN_ORDER] = block;
+                    if constexpr (STATS)
+                    {
+                        bump(m_stats.orders[index - MIN_ORDER].free_blocks, 1);
+                        bump(m_stats.free_bytes, 1 << index);
+                    }
+                }
+                else if constexpr (STATS)
+                {
+                    bump(m_stats.orders[index - MIN_ORDER].allocs, 1);
+                    bump(m_stats.used_bytes, 1 << index);
+                }
+            });
+            stats_end();
+            return true;
+        }
+        return false;
+    }
+
+    // Hands back an adopted subtree in which every allocation has been freed, or an 
+    // empty subtree if there isn't one.
+    BuddySubtree release()
+    {
+        static_assert(ADOPTING, "Adoption needs MAX_ADOPTED in the traits");
+        for (auto& adopted: m_adopted)
+        {
+            if ((adopted.base != nullptr) && (adopted.freelists[adopted.order - MIN_ORDER] != nullptr))
+            {
+                BuddySubtree subtree{adopted.base, adopted.order, adopted.base};
+                subtree.base[sizeof(uint8_t*)] = adopted.order;
+                *reinterpret_cast<uint8_t**>(subtree.base) = nullptr;
+
+                stats_begin();
+                if constexpr (STATS)
+                {
+                    bump(m_stats.orders[adopted.order - MIN_ORDER].free_blocks, -1);
+                    bump(m_stats.free_bytes, -(1 << adopted.order));
+                }
+                stats_end();
+                adopted = Adopted{};
+                return subtree;
+            }
+        }
+        return {};
+    }
+
+    // Returns a subtree which was detached from this allocator, and in which every 
+    // allocation has since been freed, to the pool. Returns false if the subtree is not
+    // from this pool, or is not wholly free.
+    bool attach(const BuddySubtree& subtree)
+    {
+        if (!subtree || !contains(subtree.base) || (subtree.free_blocks != subtree.base) || 
+            (subtree.base[sizeof(uint8_t*)] != subtree.order))
+        {
+            return false;
+        }
+
+        stats_begin();
+        if constexpr (STATS)
+        {
+            bump(m_stats.free_bytes, 1 << subtree.order);
+        }
+        coalesce(subtree.base, subtree.order);
+        stats_end();
+        return true;
+    }
+
+    // Frees every object in the cluster which contains the given object, whether or not 
+    // they have been freed individually.
+    void free_cluster(void* member)
+    {
+        free(cluster_of(static_cast<uint8_t*>(member)));
+    }
+
+    void free(void* pointer)
+    {
+        if (pointer == nullptr)
+        {
+            return;
+        }
+
+        uint8_t* block = static_cast<uint8_t*>(pointer);
+
+        // Retrieve the order - indicates the size of the allocation.
+        uint8_t order = *(block - 1);
+        if (order == CLUSTER_MEMBER)
+        {
+            free_member(block);
+            return;
+        }
+
+        free_block(block, order);
+    }
+
+    // As free(), for an allocation whose size is known, such as that of an object. Any 
+    // size which alloc() would round up to the same block will do. With a constant size
+    // the order is worked out at compile time rather than read back from the pool. Not 
+    // for cluster members.
+    void free(void* pointer, uint32_t size)
+    {
+        if (pointer != nullptr)
+        {
+            free_block(static_cast<uint8_t*>(pointer), order_of(size));
+        }
+    }
+
+private:
+    // Same layout as Stats, but readable while alloc() and free() are updating it.
+    struct AtomicOrderStats
+    {
+        std::atomic<uint32_t> allocs{};
+        std::atomic<uint32_t> frees{};
+        std::atomic<uint32_t> free_blocks{};
+        std::atomic<uint32_t> capped{};
+    };
+
+    struct AtomicStats
+    {
+        AtomicOrderStats      orders[ORDERS];
+        std::atomic<uint32_t> used_bytes{};
+        std::atomic<uint32_t> free_bytes{};
+        std::atomic<uint32_t> failures{};
+    };
+
+    // Stands in for the counters and the seqlock when they are disabled.
+    struct Unused
+    {
+    };
+
+    struct AtomicTagStats
+    {
+        std::atomic<uint32_t> live_bytes{};
+        std::atomic<uint32_t> live_count{};
+    };
+
+    // Metadata held outside the pool for each block when tracking is enabled.
+    struct Meta
+    {
+        uint16_t tag;
+        // One more than the index of the sample for this allocation, or zero. 
+        uint16_t sample;
+        // Order of the live allocation which starts at this block, or zero.
+        uint8_t  order;
+    };
+
+    using AtomicHistogram = std::atomic<uint32_t>[AGE_BUCKETS];
+
+    // Free blocks of one order held back from the free lists, and the demand for them.
+    struct Stash
+    {
+        uint8_t* head;
+        uint8_t  count;
+        uint8_t  target;
+        uint8_t  batch;
+        // Scales the share of demand, in quarters.
+        uint8_t  weight;
+        // Counted over the current period: allocations, allocations which found the 
+        // stash empty, frees which found it full, and the fewest blocks held.
+        uint16_t demand;
+        uint16_t misses;
+        uint16_t merges;
+        uint8_t  low;
+        uint32_t rate;
+    };
+
+    // A subtree adopted from another allocator, with its own free lists.
+    struct Adopted
+    {
+        uint8_t* base;
+        uint8_t  order;
+        uint8_t* freelists[ORDERS];
+    };
+
+    static constexpr uint8_t  STASH_WEIGHT     = 4;
+    static constexpr uint8_t  STASH_MAX_WEIGHT = 16;
+
+    static constexpr bool     STATS   = TRAITS::STATS;
+    static constexpr bool     TAGGED  = MAX_TAGS > 0;
+    static constexpr bool     SAMPLED = SAMPLE_INTERVAL > 0;
+    static constexpr bool     AGED    = TRAITS::AGES != TRAITS::Ages::None;
+    static constexpr bool     TRACKED = TAGGED || SAMPLED || AGED;
+    // Whether the order of every live allocation is kept in its metadata, which tags and
+    // full ages write anyway. Otherwise only samples have their order kept, so that an
+    // allocation which isn't sampled costs no more than the countdown.
+    static constexpr bool     ORDERED = TAGGED || (TRAITS::AGES == TRAITS::Ages::Full);
+    // Whether anything is read through the seqlock.
+    static constexpr bool     PUBLISHED = STATS || TAGGED || AGED;
+
+    static constexpr bool     STASHED = TRAITS::STASH_BYTES > 0;
+    static constexpr bool     ADOPTING = TRAITS::MAX_ADOPTED > 0;
+
+    static_assert(SAMPLED || (TRAITS::AGES != TRAITS::Ages::Sampled), "Sampled ages need SAMPLE_INTERVAL");
+    static constexpr uint32_t BLOCKS  = 1U << (MAX_ORDER - MIN_ORDER);
+
+    static constexpr bool     LAZY_META = TRACKED && (TRAITS::META_CHUNK_ORDER > 0);
+    static_assert(!LAZY_META || ((TRAITS::META_CHUNK_ORDER > MIN_ORDER) && (TRAITS::META_CHUNK_ORDER <= MAX_ORDER)),
+        "META_CHUNK_ORDER must be between MIN_ORDER and MAX_ORDER");
+    static constexpr uint8_t  META_CHUNK_ORDER  = LAZY_META ? TRAITS::META_CHUNK_ORDER : MAX_ORDER;
+    static constexpr uint32_t META_CHUNK_BLOCKS = 1U << (META_CHUNK_ORDER - MIN_ORDER);
+
+    // The metadata of one region, when it is allocated lazily.
+    struct MetaChunk
+    {
+        std::array<Meta, META_CHUNK_BLOCKS> meta;
+        std::array<uint32_t, (TRAITS::AGES == TRAITS::Ages::Full) ? META_CHUNK_BLOCKS : 0> births;
+    };
+
+private:
+    uint8_t* buddy_of(uint8_t* ptr, uint8_t order)
+    {
+        uint32_t size = 1U << order;
+        uint8_t* base = &m_buffer[0];
         return base + ((ptr - base) ^ size);
     }
 
+    // The rest of free(), once the order is known.
+    void free_block(uint8_t* block, uint8_t order)
+    {
+        if constexpr (ADOPTING)
+        {
+            if (!contains(block))
+            {
+                free_adopted(block, order);
+                return;
+            }
+        }
+
+        stats_begin();
+        if constexpr (STATS)
+        {
+            bump(m_stats.orders[order - MIN_ORDER].frees, 1);
+            bump(m_stats.used_bytes, -(1 << order));
+            bump(m_stats.free_bytes, 1 << order);
+        }
+        charge(order, -(1 << order));
+        if constexpr (TAGGED)
+        {
+            const Meta& meta = meta_of(block);
+            bump(m_tag_stats[meta.tag].live_bytes, -(1 << order));
+            bump(m_tag_stats[meta.tag].live_count, -1);
+        }
+        if constexpr (AGED)
+        {
+            const Meta& meta = meta_of(block);
+            if (has_birth(meta))
+            {
+                uint8_t bucket = age_bucket(TRAITS::now() - birth_of(index_of(block), meta));
+                bump(m_order_lifetimes[order - MIN_ORDER][bucket], 1);
+                if constexpr (TAGGED)
+                {
+                    bump(m_tag_lifetimes[meta.tag][bucket], 1);
+                }
+            }
+        }
+        if constexpr (SAMPLED)
+        {
+            if (meta_of(block).sample != 0)
+            {
+                unsample(block, order);
+            }
+        }
+        if constexpr (ORDERED)
+        {
+            meta_of(block).order = 0;
+        }
+
+        if constexpr (STASHED)
+        {
+            Stash& stash = m_stashes[order - MIN_ORDER];
+            if (stash.count < stash.target)
+            {
+                *reinterpret_cast<uint8_t**>(block) = stash.head;
+                stash.head = block;
+                ++stash.count;
+                if constexpr (STATS)
+                {
+                    bump(m_stats.orders[order - MIN_ORDER].free_blocks, 1);
+                }
+                stats_end();
+                return;
+            }
+            if (stash.target > 0)
+            {
+                ++stash.merges;
+            }
+        }
+
+        coalesce(block, order);
+        stats_end();
+    }
+
+    // Counts demand for order, retuning the stashes when it is time, and returns a block
+    // from the order's stash, refilling the stash first if it is empty. Returns nullptr 
+    // if the order has no stash, or the pool has nothing to refill it with.
+    uint8_t* unstash(uint8_t order)
+    {
+        Stash& stash = m_stashes[order - MIN_ORDER];
+        ++stash.demand;
+        if (--m_stash_countdown == 0)
+        {
+            m_stash_countdown = TRAITS::STASH_PERIOD;
+            retune_stashes();
+        }
+
+        if ((stash.head == nullptr) && (stash.target > 0))
+        {
+            // Blocks carved one after another come from the same larger block where
+            // possible, so a batch is mostly split from one search.
+            ++stash.misses;
+            stats_begin();
+            uint8_t batch = std::min(stash.batch, stash.target);
+            while (stash.count < batch)
+            {
+                uint8_t index = order;
+                while ((m_freelists[index - MIN_ORDER] == nullptr) && (index < MAX_ORDER))
+                {
+                    ++index;
+                }
+                if (m_freelists[index - MIN_ORDER] == nullptr)
+                {
+                    break;
+                }
+                uint8_t* block = carve(order, index);
+                *reinterpret_cast<uint8_t**>(block) = stash.head;
+                stash.head = block;
+                ++stash.count;
+                if constexpr (STATS)
+                {
+                    bump(m_stats.orders[order - MIN_ORDER].free_blocks, 1);
+                }
+            }
+            stats_end();
+        }
+
+        uint8_t* block = stash.head;
+        if (block != nullptr)
+        {
+            stash.head = *reinterpret_cast<uint8_t**>(block);
+            --stash.count;
+            stash.low = std::min(stash.low, stash.count);
+        }
+        return block;
+    }
+
+    // Folds the demand counted since the last retune into each order's rate, and shares
+    // STASH_BYTES among the orders with the highest rates. Each stash's weight and batch
+    // are doubled if more than a quarter of its allocations missed or its frees merged, 
+    // or else halved if some of its blocks were not used. Stashes over their new target,
+    // and the blocks which were not used, go back to the pool.
+    void retune_stashes()
+    {
+        bool    considered[ORDERS]{};
+        uint8_t keep[ORDERS]{};
+        for (uint8_t i = 0; i < ORDERS; ++i)
+        {
+            Stash& stash = m_stashes[i];
+            if ((stash.demand > 0) && ((uint32_t(stash.misses) + stash.merges) * 4 > stash.demand))
+            {
+                stash.weight = std::min<uint8_t>(stash.weight * 2, STASH_MAX_WEIGHT);
+                stash.batch  = static_cast<uint8_t>(std::min<uint32_t>(stash.batch * 2, TRAITS::STASH_DEPTH));
+            }
+            else if ((stash.low > 0) && (stash.low * 4 >= stash.target))
+            {
+                stash.weight = std::max<uint8_t>(stash.weight - 1, 1);
+                stash.batch  = std::max<uint8_t>(stash.batch / 2, 1);
+            }
+
+            keep[i]      = stash.count - stash.low;
+            stash.rate   = (stash.rate / 2) + stash.demand;
+            stash.demand = 0;
+            stash.misses = 0;
+            stash.merges = 0;
+            stash.target = 0;
+        }
+
+        // Hottest first. There are only a few orders, so a selection will do.
+        uint32_t budget = TRAITS::STASH_BYTES;
+        while (true)
+        {
+            uint8_t hottest = ORDERS;
+            for (uint8_t i = 0; i < ORDERS; ++i)
+            {
+                if (!considered[i] && (m_stashes[i].rate > 0) && 
+                    ((hottest == ORDERS) || (m_stashes[i].rate > m_stashes[hottest].rate)))
+                {
+                    hottest = i;
+                }
+            }
+            if (hottest == ORDERS)
+            {
+                break;
+            }
+
+            // In steady state the rate is twice the demand per period.
+            considered[hottest] = true;
+            uint32_t depth = uint32_t(m_stashes[hottest].rate) * TRAITS::STASH_DEPTH * 
+                             m_stashes[hottest].weight / (TRAITS::STASH_PERIOD * STASH_WEIGHT);
+            depth = std::min({depth, uint32_t(TRAITS::STASH_DEPTH), budget >> (MIN_ORDER + hottest)});
+            m_stashes[hottest].target = static_cast<uint8_t>(depth);
+            budget -= depth << (MIN_ORDER + hottest);
+        }
+
+        stats_begin();
+        for (uint8_t i = 0; i < ORDERS; ++i)
+        {
+            shrink_stash(MIN_ORDER + i, std::min(m_stashes[i].target, keep[i]));
+            m_stashes[i].low = m_stashes[i].count;
+        }
+        stats_end();
+    }
+
+    // Returns blocks from the stash for order to the free lists until it holds no more 
+    // than count. Must be called between stats_begin() and stats_end().
+    void shrink_stash(uint8_t order, uint8_t count)
+    {
+        Stash& stash = m_stashes[order - MIN_ORDER];
+        while (stash.count > count)
+        {
+            uint8_t* block = stash.head;
+            stash.head = *reinterpret_cast<uint8_t**>(block);
+            --stash.count;
+            if constexpr (STATS)
+            {
+                bump(m_stats.orders[order - MIN_ORDER].free_blocks, -1);
+            }
+            coalesce(block, order);
+        }
+    }
+
+    // Calls f(uint8_t* block, uint8_t order, bool free) for each block in a subtree, in 
+    // address order. The free blocks are known from the chain, and every other block is
+    // live, with its order in the byte in front. Returns false if the blocks don't tile
+    // the subtree exactly, when f may have been called for blocks which are not real.
+    template <typename F>
+    static bool walk_subtree(const BuddySubtree& subtree, F f)
+    {
+        uint8_t* block = subtree.base;
+        uint8_t* end   = subtree.base + (1U << subtree.order);
+        uint8_t* next  = subtree.free_blocks;
+        while (block < end)
+        {
+            bool    is_free = (block == next);
+            uint8_t order   = is_free ? block[sizeof(uint8_t*)] : *(block - 1);
+            if ((order < MIN_ORDER) || (order > subtree.order) || 
+                (((block - subtree.base) & ((1U << order) - 1)) != 0))
+            {
+                return false;
+            }
+            if (is_free)
+            {
+                next = *reinterpret_cast<uint8_t**>(block);
+            }
+            f(block, order, is_free);
+            block += 1U << order;
+        }
+        return (block == end) && (next == nullptr);
+    }
+
+    // As free(), for a block in an adopted subtree. The block only coalesces within the
+    // subtree.
+    void free_adopted(uint8_t* block, uint8_t order)
+    {
+        for (auto& adopted: m_adopted)
+        {
+            if ((block < adopted.base) || (block >= (adopted.base + (1U << adopted.order))))
+            {
+                continue;
+            }
+
+            stats_begin();
+            if constexpr (STATS)
+            {
+                bump(m_stats.orders[order - MIN_ORDER].frees, 1);
+                bump(m_stats.used_bytes, -(1 << order));
+                bump(m_stats.free_bytes, 1 << order);
+            }
+            while (true)
+            {
+                uint8_t*  buddy = adopted.base + ((block - adopted.base) ^ (1U << order));
+                uint8_t** ptr   = &adopted.freelists[order - MIN_ORDER];
+                while ((*ptr != nullptr) && (*ptr != buddy))
+                {
+                    ptr = reinterpret_cast<uint8_t**>(*ptr);
+                }
+                if ((order == adopted.order) || (*ptr == nullptr))
+                {
+                    *reinterpret_cast<uint8_t**>(block) = adopted.freelists[order - MIN_ORDER];
+                    adopted.freelists[order - MIN_ORDER] = block;
+                    if constexpr (STATS)
+                    {
+                        bump(m_stats.orders[order - MIN_ORDER].free_blocks, 1);
+                    }
+                    break;
+                }
+                *ptr = *reinterpret_cast<uint8_t**>(buddy);
+                if constexpr (STATS)
+                {
+                    bump(m_stats.orders[order - MIN_ORDER].free_blocks, -1);
+                }
+                block = std::min(block, buddy);
+                ++order;
+            }
+            stats_end();
+            return;
+        }
+    }
+
+    // Puts a free block in the free list for its order, first combining it with its
+    // buddy for as long as the buddy is free. Must be called between stats_begin() and
+    // stats_end().
+    void coalesce(uint8_t* block, uint8_t order)
+    {
+        uint8_t* freed       = block;
+        uint8_t  freed_order = order;
+        while (true)
+        {
+            // Is the buddy block already free?
+            uint8_t* buddy = buddy_of(block, order);            
+            // Use a pointer to pointer so we can modify the value later. A list in address
+            // order can only hold the buddy before the first higher block.
+            uint8_t** ptr = &m_freelists[order - MIN_ORDER];
+            while ((*ptr != nullptr) && (*ptr != buddy) && (!TWO_ENDED || (*ptr < buddy)))
+            {
+                ptr = reinterpret_cast<uint8_t**>(*ptr);
+            }
+
+            // If the buddy was not found in the free list we are done.
+            if (*ptr != buddy)
+            {
+                // Nothing lies between the block and its buddy, so a list in address 
+                // order takes the block where the search stopped. 
+                uint8_t** at = TWO_ENDED ? ptr : &m_freelists[order - MIN_ORDER];
+                // Equivalent to having a linked list of struct Pointer { Pointer* next; }; 
+                *reinterpret_cast<uint8_t**>(block) = *at;
+                *at = block;
+                if constexpr (STATS)
+                {
+                    bump(m_stats.orders[order - MIN_ORDER].free_blocks, 1);
+                }
+
+                // The metadata of any region now entirely free goes. Only the regions 
+                // of the freed block can have any, as the rest were free already.
+                if constexpr (LAZY_META)
+                {
+                    if (order >= META_CHUNK_ORDER)
+                    {
+                        release_metadata(freed, freed_order);
+                    }
+                }
+                return;
+            }
+
+            // The buddy was found in the free list. We will coalesce.
+            // Remove the buddy from the free list by assigning the next item in the list.
+            *ptr = *reinterpret_cast<uint8_t**>(*ptr);
+            if constexpr (STATS)
+            {
+                bump(m_stats.orders[order - MIN_ORDER].free_blocks, -1);
+            }
+
+            // Take the lower address of the block and its buddy for adding into the 
+            // next free list.
+            block = std::min(block, buddy);
+            ++order;
+        }
+    }
+
+    // The order, from index up, whose free list holds the free block with the highest 
+    // address. The lists are in address order, so this is the last block of one of them.
+    uint8_t highest_order(uint8_t index) const
+    {
+        const uint8_t* highest = nullptr;
+        uint8_t        result  = index;
+        for (uint8_t i = index; i <= MAX_ORDER; ++i)
+        {
+            for (uint8_t* block = m_freelists[i - MIN_ORDER]; block != nullptr; 
+                 block = *reinterpret_cast<uint8_t**>(block))
+            {
+                if (block > highest)
+                {
+                    highest = block;
+                    result  = i;
+                }
+            }
+        }
+        return result;
+    }
+
+    // Adds a block to the free list for order: at the head, or in address order for two
+    // ended placement. Must be called between stats_begin() and stats_end().
+    void push_free(uint8_t* block, uint8_t order)
+    {
+        uint8_t** ptr = &m_freelists[order - MIN_ORDER];
+        if constexpr (TWO_ENDED)
+        {
+            while ((*ptr != nullptr) && (*ptr < block))
+            {
+                ptr = reinterpret_cast<uint8_t**>(*ptr);
+            }
+        }
+        // Equivalent to having a linked list of struct Pointer { Pointer* next; }; 
+        *reinterpret_cast<uint8_t**>(block) = *ptr;
+        *ptr = block;
+        if constexpr (STATS)
+        {
+            bump(m_stats.orders[order - MIN_ORDER].free_blocks, 1);
+        }
+    }
+
+    // Removes a block from the free list for index, splits it down to order, and marks 
+    // it as allocated. The free list must not be empty.
+    uint8_t* take(uint8_t order, uint8_t index, uint32_t tag)
+    {
+        stats_begin();
+        return hand_out(carve(order, index), order, tag);
+    }
+
+    // Removes a block from the free list for index and splits it down to order, putting
+    // the other halves in the free lists. The free list must not be empty. This is the 
+    // first block in the list, except that two ended placement takes the last (highest)
+    // block for a large order, and keeps the upper half of each split. Must be called 
+    // between stats_begin() and stats_end().
+    uint8_t* carve(uint8_t order, uint8_t index)
+    {
+        uint8_t** ptr  = &m_freelists[index - MIN_ORDER];
+        bool      high = TWO_ENDED && (order >= TRAITS::LARGE_ORDER);
+        while (high && (*reinterpret_cast<uint8_t**>(*ptr) != nullptr))
+        {
+            ptr = reinterpret_cast<uint8_t**>(*ptr);
+        }
+        uint8_t* block = *ptr;
+
+        // Store any buddies in the relevant free lists. 
+        *ptr = *reinterpret_cast<uint8_t**>(block);
+        if constexpr (STATS)
+        {
+            bump(m_stats.orders[index - MIN_ORDER].free_blocks, -1);
+        }
+        while (index > order)
+        {
+            --index;
+            uint8_t* buddy = buddy_of(block, index);
+            if (high)
+            {
+                std::swap(block, buddy);
+            }
+            push_free(buddy, index);
+        }
+        return block;
+    }
+
+    // Marks a free block of order, which is in no free list, as allocated. Completes the 
+    // update of the stats which the caller started with stats_begin().
+    uint8_t* hand_out(uint8_t* block, uint8_t order, uint32_t tag)
+    {
+        if constexpr (LAZY_META)
+        {
+            if (!ensure_metadata(block))
+            {
+                coalesce(block, order);
+                if constexpr (STATS)
+                {
+                    bump(m_stats.failures, 1);
+                }
+                stats_end();
+                return nullptr;
+            }
+        }
+
+        if constexpr (STATS)
+        {
+            bump(m_stats.orders[order - MIN_ORDER].allocs, 1);
+            bump(m_stats.used_bytes, 1 << order);
+            bump(m_stats.free_bytes, -(1 << order));
+        }
+        charge(order, 1 << order);
+        if constexpr (ORDERED)
+        {
+            meta_of(block).order = order;
+        }
+        if constexpr (TAGGED)
+        {
+            Meta& meta = meta_of(block);
+            meta.tag   = static_cast<uint16_t>(tag % MAX_TAGS);
+            bump(m_tag_stats[meta.tag].live_bytes, 1 << order);
+            bump(m_tag_stats[meta.tag].live_count, 1);
+        }
+        if constexpr (TRAITS::AGES == TRAITS::Ages::Full)
+        {
+            birth_at(index_of(block)) = TRAITS::now();
+        }
+        stats_end();
+
+        // This is the only cost of the profiler for allocations which are not sampled.
+        if constexpr (SAMPLED)
+        {
+            m_sample_countdown -= 1 << order;
+            if (m_sample_countdown < 0)
+            {
+                sample(block, order);
+            }
+        }
+
+        // Store the order so that we know how to free this pointer later.
+        *(block - 1) = order;
+        return block;
+    }
+
+    // Occupancy caps. The check is a single compare against the band's counter.
+    bool over_cap(uint8_t order) const
+    {
+        uint8_t band = m_band_of[order - MIN_ORDER];
+        return (m_band_used[band] + (1U << order)) > m_band_cap[band];
+    }
+
+    void count_capped(uint8_t order)
+    {
+        if constexpr (STATS)
+        {
+            stats_begin();
+            bump(m_stats.orders[order - MIN_ORDER].capped, 1);
+            stats_end();
+        }
+    }
+
+    // Caps need the stats, so without them there is nothing to charge.
+    void charge(uint8_t order, int32_t bytes)
+    {
+        if constexpr (STATS)
+        {
+            m_band_used[m_band_of[order - MIN_ORDER]] += bytes;
+        }
+    }
+
+    void count_failure()
+    {
+        if constexpr (STATS)
+        {
+            stats_begin();
+            bump(m_stats.failures, 1);
+            stats_end();
+        }
+    }
+
+    // The block containing a member of a cluster made with alloc_cluster().
+    static uint8_t* cluster_of(uint8_t* member)
+    {
+        uint32_t offset;
+        std::memcpy(&offset, member - sizeof(uint32_t) - 1, sizeof(uint32_t));
+        return member - offset;
+    }
+
+    void free_member(uint8_t* member)
+    {
+        uint8_t*  block = cluster_of(member);
+        uint32_t& count = *reinterpret_cast<uint32_t*>(block);
+        if (--count == 0)
+        {
+            free(block);
+        }
+    }
+
+    // Out-of-band metadata is kept for each minimum sized block, indexed by offset.
+    uint32_t index_of(const uint8_t* block) const
+    {
+        return static_cast<uint32_t>((block - &m_buffer[0]) >> MIN_ORDER);
+    }
+
+    // Only for blocks which have metadata: live blocks, and blocks being handed out 
+    // after ensure_metadata().
+    Meta& meta_of(uint8_t* block)
+    {
+        uint32_t index = index_of(block);
+        if constexpr (LAZY_META)
+        {
+            return m_meta_chunks[index / META_CHUNK_BLOCKS]->meta[index % META_CHUNK_BLOCKS];
+        }
+        else
+        {
+            return m_meta[index];
+        }
+    }
+
+    uint32_t& birth_at(uint32_t index)
+    {
+        if constexpr (LAZY_META)
+        {
+            return m_meta_chunks[index / META_CHUNK_BLOCKS]->births[index % META_CHUNK_BLOCKS];
+        }
+        else
+        {
+            return m_births[index];
+        }
+    }
+
+    uint32_t birth_at(uint32_t index) const
+    {
+        if constexpr (LAZY_META)
+        {
+            return m_meta_chunks[index / META_CHUNK_BLOCKS]->births[index % META_CHUNK_BLOCKS];
+        }
+        else
+        {
+            return m_births[index];
+        }
+    }
+
+    // The metadata for the block index, which runs on to the end of its region, or 
+    // nullptr if the region has none, in which case nothing in it is live.
+    const Meta* find_meta(uint32_t index) const
+    {
+        if constexpr (LAZY_META)
+        {
+            const MetaChunk* chunk = m_meta_chunks[index / META_CHUNK_BLOCKS];
+            return (chunk != nullptr) ? &chunk->meta[index % META_CHUNK_BLOCKS] : nullptr;
+        }
+        else
+        {
+            return &m_meta[index];
+        }
+    }
+
+    // Calls f(index, meta) for each live allocation which starts in the count blocks 
+    // from first. Regions without metadata are skipped whole.
+    template <typename F>
+    void for_each_live_meta(uint32_t first, uint32_t count, F f) const
+    {
+        uint32_t end = first + count;
+        for (uint32_t i = first; i < end; )
+        {
+            uint32_t stop = std::min(end, (i | (META_CHUNK_BLOCKS - 1)) + 1);
+            if (const Meta* meta = find_meta(i))
+            {
+                for (; i < stop; ++i, ++meta)
+                {
+                    if (meta->order != 0)
+                    {
+                        f(i, *meta);
+                    }
+                }
+            }
+            i = stop;
+        }
+    }
+
+    // Allocates the metadata for the region holding block, if it has none.
+    bool ensure_metadata(uint8_t* block)
+    {
+        MetaChunk*& chunk = m_meta_chunks[index_of(block) / META_CHUNK_BLOCKS];
+        if (chunk == nullptr)
+        {
+            void* memory = TRAITS::alloc_metadata(sizeof(MetaChunk));
+            if (memory == nullptr)
+            {
+                return false;
+            }
+            // The memory is zeroed, which is the state the metadata starts in.
+            chunk = new (memory) MetaChunk;
+            ++m_meta_chunk_count;
+        }
+        return true;
+    }
+
+    // Frees the metadata of the regions covered by a block, or of the region holding 
+    // it if it is smaller.
+    void release_metadata(uint8_t* block, uint8_t order)
+    {
+        uint32_t first = index_of(block) / META_CHUNK_BLOCKS;
+        uint32_t count = (order > META_CHUNK_ORDER) ? (1U << (order - META_CHUNK_ORDER)) : 1;
+        for (uint32_t i = first; i < (first + count); ++i)
+        {
+            if (m_meta_chunks[i] != nullptr)
+            {
+                TRAITS::free_metadata(m_meta_chunks[i]);
+                m_meta_chunks[i] = nullptr;
+                --m_meta_chunk_count;
+            }
+        }
+    }
+
+    // Bytes in live allocations within the region of the given order starting at the 
+    // block index. A region inside a larger allocation is entirely in use.
+    uint32_t region_used_bytes(uint32_t first, uint8_t order) const
+    {
+        for (uint8_t outer = order + 1; outer <= MAX_ORDER; ++outer)
+        {
+            uint32_t    start = first & ~((1U << (outer - MIN_ORDER)) - 1);
+            const Meta* meta  = find_meta(start);
+            if ((meta != nullptr) && (meta->order == outer))
+            {
+                return 1U << order;
+            }
+        }
+
+        uint32_t used = 0;
+        for_each_live_meta(first, 1U << (order - MIN_ORDER), [&](uint32_t, const Meta& meta)
+        {
+            used += 1U << meta.order;
+        });
+        return used;
+    }
+
+    // Whether the allocation time was recorded. In Sampled mode the time is kept with 
+    // the sample rather than for every block.
+    bool has_birth(const Meta& meta) const
+    {
+        return (TRAITS::AGES == TRAITS::Ages::Full) || (meta.sample != 0);
+    }
+
+    uint32_t birth_of(uint32_t index, const Meta& meta) const
+    {
+        if constexpr (TRAITS::AGES == TRAITS::Ages::Full)
+        {
+            return birth_at(index);
+        }
+        else
+        {
+            return m_sample_births[meta.sample - 1];
+        }
+    }
+
+    static void copy_histogram(const AtomicHistogram& from, AgeHistogram& to)
+    {
+        for (uint8_t i = 0; i < AGE_BUCKETS; ++i)
+        {
+            to.counts[i] = from[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    static constexpr std::array<uint16_t, SAMPLED ? TRAITS::MAX_SAMPLES : 0> make_sample_list()
+    {
+        std::array<uint16_t, SAMPLED ? TRAITS::MAX_SAMPLES : 0> list{};
+        for (size_t i = 0; (i + 1) < list.size(); ++i)
+        {
+            list[i] = uint16_t(i + 2);
+        }
+        return list;
+    }
+
+    // Draws the number of bytes until the next sample from an exponential distribution, 
+    // so that the sampling is not biased by regular allocation patterns. This is what 
+    // pprof assumes when it scales the samples back up.
+    int32_t next_sample_interval()
+    {
+        // xorshift64* is plenty for this.
+        m_sample_random ^= m_sample_random >> 12;
+        m_sample_random ^= m_sample_random << 25;
+        m_sample_random ^= m_sample_random >> 27;
+        uint64_t bits = (m_sample_random * 2685821657736338717ULL) >> 11;
+
+        double uniform  = (bits + 1) * (1.0 / 9007199254740992.0); // (0, 1]
+        double interval = -std::log(uniform) * SAMPLE_INTERVAL;
+        return static_cast<int32_t>(std::min(interval, 2147483647.0));
+    }
+
+    // Records the allocation's stack. Only called for sampled allocations.
+    void sample(uint8_t* block, uint8_t order)
+    {
+        // Carry the overshoot into the next interval so that, on average, there is one 
+        // sample for every SAMPLE_INTERVAL bytes allocated.
+        do
+        {
+            m_sample_countdown += next_sample_interval();
+        } 
+        while (m_sample_countdown < 0);
+
+        if (m_free_sample == 0)
+        {
+            return;
+        }
+
+        void*   frames[TRAITS::SAMPLE_DEPTH];
+        uint8_t depth = TRAITS::backtrace(frames, TRAITS::SAMPLE_DEPTH);
+
+        uint16_t stack = 0;
+        while ((stack < m_stack_count) && !((m_stacks[stack].depth == depth) && 
+            std::equal(frames, frames + depth, m_stacks[stack].frames)))
+        {
+            ++stack;
+        }
+        if (stack == m_stack_count)
+        {
+            if (m_stack_count == TRAITS::MAX_STACKS)
+            {
+                return;
+            }
+            m_stacks[stack] = SampledStack{};
+            std::copy(frames, frames + depth, m_stacks[stack].frames);
+            m_stacks[stack].depth = depth;
+            ++m_stack_count;
+        }
+
+        SampledStack& s = m_stacks[stack];
+        s.live_count  += 1;
+        s.live_bytes  += 1U << order;
+        s.total_count += 1;
+        s.total_bytes += 1U << order;
+
+        // Samples are linked through their stack field while unused.
+        uint16_t index = m_free_sample - 1;
+        m_free_sample = m_samples[index];
+        m_samples[index] = stack;
+        meta_of(block).sample = index + 1;
+        if constexpr (!ORDERED)
+        {
+            meta_of(block).order = order;
+        }
+        if constexpr (TRAITS::AGES == TRAITS::Ages::Sampled)
+        {
+            m_sample_births[index] = TRAITS::now();
+        }
+    }
+
+    void unsample(uint8_t* block, uint8_t order)
+    {
+        Meta& meta = meta_of(block);
+        uint16_t index = meta.sample - 1;
+        meta.sample = 0;
+        if constexpr (!ORDERED)
+        {
+            meta.order = 0;
+        }
+
+        SampledStack& s = m_stacks[m_samples[index]];
+        s.live_count -= 1;
+        s.live_bytes -= 1U << order;
+
+        m_samples[index] = m_free_sample;
+        m_free_sample = index + 1;
+    }
+
+    // Reader side of the seqlock. Repeats the copy until it was not overlapped by an update.
+    template <typename COPY>
+    void read_consistent(COPY copy) const
+    {
+        while (true)
+        {
+            uint32_t before = m_stats_seq.load(std::memory_order_acquire);
+            if ((before & 1U) == 0)
+            {
+                copy();
+                // Make sure the copy is complete before checking the sequence again.
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (m_stats_seq.load(std::memory_order_relaxed) == before)
+                {
+                    return;
+                }
+            }
+        }
+    }
+
+    // Writer side of the seqlock which protects the stats. The sequence is odd while 
+    // an update is in progress. There is only ever one writer (alloc() and free() are 
+    // not reentrant), so plain loads and stores suffice and avoid read-modify-write 
+    // instructions which are expensive or missing on small targets. Both do nothing if 
+    // nothing is published.
+    void stats_begin()
+    {
+        if constexpr (PUBLISHED)
+        {
+            m_stats_seq.store(m_stats_seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+        }
+    }
+
+    void stats_end()
+    {
+        if constexpr (PUBLISHED)
+        {
+            m_stats_seq.store(m_stats_seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+    }
+
+    static void bump(std::atomic<uint32_t>& counter, int32_t delta)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+
 private:
     // Each power of 2 has it's own free list of buddies not yet coalesced. 
     uint8_t* m_freelists[MAX_ORDER - MIN_ORDER + 1]{};
+    // Occupancy caps: the band of each order, and the bytes used by and allowed for each 
+    // band, indexed by band.
+    uint8_t  m_band_of[ORDERS]{};
+    uint32_t m_band_used[ORDERS]{};
+    uint32_t m_band_cap[ORDERS]{};
+    // Counters for monitoring, and the sequence number used to read them consistently.
+    std::conditional_t<STATS, AtomicStats, Unused>                 m_stats{};
+    std::conditional_t<PUBLISHED, std::atomic<uint32_t>, Unused>   m_stats_seq{};
+    // Live totals for each tag. Empty unless tagging is enabled.
+    std::array<AtomicTagStats, MAX_TAGS> m_tag_stats{};
+    // Indexed by block offset >> MIN_ORDER. Empty unless tracking is enabled, or if 
+    // the metadata is allocated lazily, in which case there is a pointer for each region.
+    std::array<Meta, (TRACKED && !LAZY_META) ? BLOCKS : 0> m_meta{};
+    std::array<MetaChunk*, LAZY_META ? (BLOCKS / META_CHUNK_BLOCKS) : 0> m_meta_chunks{};
+    uint32_t m_meta_chunk_count{};
+    // Heap profiler state. Each live sample holds the index of its stack. The unused 
+    // samples form a free list (one-based so that zero can mean empty).
+    std::array<SampledStack, SAMPLED ? TRAITS::MAX_STACKS : 0>  m_stacks{};
+    std::array<uint16_t, SAMPLED ? TRAITS::MAX_SAMPLES : 0>     m_samples{make_sample_list()};
+    std::array<uint32_t, (TRAITS::AGES == TRAITS::Ages::Sampled) ? TRAITS::MAX_SAMPLES : 0> m_sample_births{};
+    uint16_t m_stack_count{};
+    uint16_t m_free_sample{SAMPLED ? 1 : 0};
+    int32_t  m_sample_countdown{};
+    uint64_t m_sample_random{0x9E3779B97F4A7C15ULL};
+    // Allocation times for Full ages, indexed like the metadata, and lifetime histograms
+    // of freed allocations.
+    std::array<uint32_t, ((TRAITS::AGES == TRAITS::Ages::Full) && !LAZY_META) ? BLOCKS : 0> m_births{};
+    std::array<AtomicHistogram, AGED ? ORDERS : 0>          m_order_lifetimes{};
+    std::array<AtomicHistogram, (AGED && TAGGED) ? MAX_TAGS : 0> m_tag_lifetimes{};
+    // Subtrees adopted from other allocators. Unused entries have a null base.
+    std::array<Adopted, TRAITS::MAX_ADOPTED> m_adopted{};
+    // Pre-split stashes, indexed by order. Empty unless stashes are enabled.
+    std::array<Stash, STASHED ? ORDERS : 0> m_stashes{};
+    uint16_t m_stash_countdown{TRAITS::STASH_PERIOD};
     // This is needed to account for the order storage in the block with the lowest address.
     uint8_t  m_dummy{};
-    // Static buffer used to supply all the allocations.
+    // Static buffer used to supply all the allocations. Deliberately not initialised, 
+    // so that constructing the allocator in mapped memory does not touch every page.
     alignas(ALIGNMENT)
-    uint8_t  m_buffer[1 << MAX_ORDER]{};
+    uint8_t  m_buffer[1 << MAX_ORDER];
 };
 
 
@@ -0,0 +1,470 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2020 Alan Chambers (unicycle.bloke@gmail.com)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+///////////////////////////////////////////////////////////////////////////////
+#pragma once
+#include "BuddyAllocator.h"
+#include <array>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+namespace ub {
+
+
+// Places an allocator in memory obtained directly from mmap() rather than on the stack,
+// the heap or in static storage. POSIX only. The memory is either anonymous, or shared 
+// with an unlinked temporary file so that the kernel can write cold pages out to disk
+// rather than keeping them in RAM. The allocator's own pool is page aligned, and pages
+// are only touched when they are used. If the mapping fails, the arena is empty and 
+// alloc() returns nullptr.
+template <typename POOL>
+class MappedArena
+{
+public:
+    // Anonymous private memory.
+    MappedArena()
+    {
+        map(-1);
+    }
+
+    // Memory shared with a new temporary file in the given directory. The file is 
+    // unlinked immediately, so nothing is left behind.
+    explicit MappedArena(const char* directory)
+    {
+        std::string path = std::string{directory} + "/buddy-XXXXXX";
+        int fd = ::mkstemp(path.data());
+        if (fd < 0)
+        {
+            return;
+        }
+        ::unlink(path.c_str());
+
+        if (::ftruncate(fd, static_cast<off_t>(mapping_size())) == 0)
+        {
+            map(fd);
+        }
+        ::close(fd);
+    }
+
+    ~MappedArena()
+    {
+        if (m_pool != nullptr)
+        {
+            m_pool->~POOL();
+            ::munmap(m_mapping, m_size);
+        }
+    }
+
+    MappedArena(const MappedArena&) = delete;
+    MappedArena& operator=(const MappedArena&) = delete;
+
+    explicit operator bool() const
+    {
+        return m_pool != nullptr;
+    }
+
+    POOL& pool()
+    {
+        return *m_pool;
+    }
+
+    const POOL& pool() const
+    {
+        return *m_pool;
+    }
+
+    void* alloc(uint32_t size)
+    {
+        return (m_pool != nullptr) ? m_pool->alloc(size) : nullptr;
+    }
+
+    void free(void* pointer)
+    {
+        m_pool->free(pointer);
+    }
+
+    bool contains(const void* pointer) const
+    {
+        return (m_pool != nullptr) && m_pool->contains(pointer);
+    }
+
+    // Advises the whole pages within a block as cold (MADV_COLD), so that they are 
+    // preferred for reclaim. Advice only affects resident pages, so it must be given 
+    // once a block is in use rather than when the arena is mapped. A no-op where 
+    // MADV_COLD isn't defined.
+    void advise_cold(void* pointer, uint32_t size)
+    {
+#ifdef MADV_COLD
+        size_t    page  = page_size();
+        auto      block = reinterpret_cast<uintptr_t>(pointer);
+        uintptr_t begin = (block + page - 1) & ~(page - 1);
+        uintptr_t end   = (block + size) & ~(page - 1);
+        if (begin < end)
+        {
+            ::madvise(reinterpret_cast<void*>(begin), end - begin, MADV_COLD);
+        }
+#else
+        (void)pointer;
+        (void)size;
+#endif
+    }
+
+    // Sets how long free pages may stay resident before purge() gives them back to the 
+    // OS. Zero purges every free page at each call, and a negative time disables 
+    // purging. The default is ten seconds.
+    void set_decay(std::chrono::milliseconds decay)
+    {
+        m_decay = decay;
+        m_backlog.fill(0);
+    }
+
+    // Gives free pages back to the OS, gradually. Call this now and then, for example 
+    // from a housekeeping timer. Releasing pages as soon as they are freed thrashes when
+    // they are wanted again a moment later, so instead the pages which become free in
+    // each of DECAY_EPOCHS epochs are allowed to stay resident for a while. The number 
+    // allowed falls from all of them to none along a smoothstep curve over the decay
+    // time, and anything over the total allowed is purged, largest free blocks first.
+    // Returns the number of pages purged. Must be serialised with alloc() and free().
+    size_t purge(std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now())
+    {
+        if ((m_pool == nullptr) || (m_decay.count() < 0))
+        {
+            return 0;
+        }
+
+        size_t dirty = dirty_pages();
+        if (m_decay.count() == 0)
+        {
+            m_last_dirty = 0;
+            return release(dirty);
+        }
+
+        // Nothing changes until an epoch has passed.
+        auto epoch = std::max(m_decay / static_cast<int>(DECAY_EPOCHS), std::chrono::milliseconds{1});
+        if (now < (m_epoch_start + epoch))
+        {
+            return 0;
+        }
+        auto elapsed = (now - m_epoch_start) / epoch;
+        m_epoch_start += elapsed * epoch;
+
+        // The backlog holds the pages made dirty in each epoch, newest first.
+        size_t shift = std::min(static_cast<size_t>(elapsed), DECAY_EPOCHS);
+        std::move_backward(m_backlog.begin(), m_backlog.end() - shift, m_backlog.end());
+        std::fill(m_backlog.begin(), m_backlog.begin() + shift, 0);
+        m_backlog[0] = (dirty > m_last_dirty) ? (dirty - m_last_dirty) : 0;
+
+        double limit = 0;
+        for (size_t i = 0; i < DECAY_EPOCHS; ++i)
+        {
+            double x = double(i + 1) / DECAY_EPOCHS;
+            limit += m_backlog[i] * (1.0 - x * x * (3.0 - 2.0 * x));
+        }
+
+        size_t purged = (dirty > limit) ? release(dirty - static_cast<size_t>(limit)) : 0;
+        m_last_dirty  = dirty - std::min(dirty, purged);
+        return purged;
+    }
+
+    // The number of resident pages lying wholly within free blocks, which could be 
+    // given back to the OS. Walks the free lists and asks the OS about each block, so 
+    // is not cheap.
+    size_t dirty_pages() const
+    {
+        size_t dirty = 0;
+        for_each_purgeable([&](uint8_t* begin, size_t size)
+        {
+            dirty += resident(begin, size, [](uint8_t*, size_t) { return true; });
+            return true;
+        });
+        return dirty;
+    }
+
+    // As BuddyAllocator::realloc(). When a block of MREMAP_MIN_SIZE or more has to move, 
+    // the whole pages are moved into the new block with mremap() rather than copied, so 
+    // the cost scales with page table entries rather than bytes. The old block's pages
+    // are replaced with fresh zero pages before it is freed. Only anonymous arenas move
+    // pages: the pages of a file backed arena are copied as usual.
+    void* realloc(void* pointer, uint32_t size)
+    {
+        if (m_pool == nullptr)
+        {
+            return nullptr;
+        }
+        return m_pool->realloc(pointer, size, [this](void* to, const void* from, uint32_t bytes)
+        {
+            move(static_cast<uint8_t*>(to), static_cast<const uint8_t*>(from), bytes);
+        });
+    }
+
+private:
+    static constexpr uint32_t MREMAP_MIN_SIZE = 64 * 1024;
+    static constexpr size_t   DECAY_EPOCHS    = 32;
+
+    static size_t page_size()
+    {
+        return static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    }
+
+    // Room for the allocator plus up to a page to align its pool.
+    static size_t mapping_size()
+    {
+        size_t page = page_size();
+        return (sizeof(POOL) + (2 * page) - 1) & ~(page - 1);
+    }
+
+    void map(int fd)
+    {
+        size_t size  = mapping_size();
+        int    flags = (fd < 0) ? (MAP_PRIVATE | MAP_ANONYMOUS) : MAP_SHARED;
+        void*  base  = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+        if (base == MAP_FAILED)
+        {
+            return;
+        }
+
+        // Construct once to find where the pool lies within the allocator, and again 
+        // at an offset which puts it on a page boundary. Construction only touches the
+        // allocator's header, so this is cheap.
+        auto   bytes  = static_cast<uint8_t*>(base);
+        POOL*  pool   = new (bytes) POOL{};
+        size_t offset = static_cast<const uint8_t*>(pool->ptr_from_offset(0)) - bytes;
+        size_t page   = page_size();
+        size_t shift  = (page - (offset % page)) % page;
+        if (shift != 0)
+        {
+            pool->~POOL();
+            pool = new (bytes + shift) POOL{};
+        }
+
+        m_mapping   = base;
+        m_size      = size;
+        m_pool      = pool;
+        m_anonymous = (fd < 0);
+    }
+
+    // Blocks of a page or more are page aligned because the pool is. The bytes are the 
+    // capacity of the source block, one less than its size. Only whole pages are moved, 
+    // and the rest is copied. The destination is larger, so its last byte, which holds 
+    // the order of the next block, is never touched. The source's last byte holds the
+    // order of the block after it, so is put back once its page has been replaced.
+    void move(uint8_t* to, const uint8_t* from, uint32_t bytes)
+    {
+        size_t page  = page_size();
+        size_t size  = size_t{bytes} + 1;
+#ifdef MREMAP_FIXED
+        size_t pages = m_anonymous ? (size & ~(page - 1)) : 0;
+#else
+        size_t pages = 0;
+#endif
+        if ((size < MREMAP_MIN_SIZE) || (pages == 0) || 
+            ((reinterpret_cast<uintptr_t>(to) | reinterpret_cast<uintptr_t>(from)) & (page - 1)))
+        {
+            std::memcpy(to, from, bytes);
+            return;
+        }
+
+        // On failure mremap() may already have unmapped the destination, so it is mapped 
+        // afresh before copying. The source is left alone. If either range can't be 
+        // mapped again, the pool has a hole in it which can't be repaired, so give up 
+        // rather than go on to touch unmapped memory.
+#ifdef MREMAP_FIXED
+        auto    source = const_cast<uint8_t*>(from);
+        uint8_t next   = from[bytes];
+        if (::mremap(source, pages, pages, MREMAP_MAYMOVE | MREMAP_FIXED, to) == MAP_FAILED)
+        {
+            if (!remap(to, pages))
+            {
+                std::abort();
+            }
+            std::memcpy(to, from, bytes);
+            return;
+        }
+        if (!remap(source, pages))
+        {
+            std::abort();
+        }
+        if (pages < size)
+        {
+            std::memcpy(to + pages, from + pages, bytes - pages);
+        }
+        source[bytes] = next;
+#endif
+    }
+
+    // Calls f(uint8_t* begin, size_t size) for the whole pages within each free block, 
+    // leaving out the first bytes and the last byte of the block, until f returns false.
+    template <typename F>
+    void for_each_purgeable(F f) const
+    {
+        size_t page = page_size();
+        bool   more = true;
+        m_pool->for_each_free([&](void* pointer, uint32_t size)
+        {
+            auto      block = reinterpret_cast<uintptr_t>(pointer);
+            uintptr_t begin = (block + sizeof(void*) + page - 1) & ~(page - 1);
+            uintptr_t end   = (block + size - 1) & ~(page - 1);
+            if (more && (begin < end))
+            {
+                more = f(reinterpret_cast<uint8_t*>(begin), end - begin);
+            }
+        });
+    }
+
+    // Counts the resident pages in a page aligned range, calling f(uint8_t* begin, 
+    // size_t size) with each run of them. Stops early if f returns false.
+    template <typename F>
+    static size_t resident(uint8_t* begin, size_t size, F f)
+    {
+        size_t page  = page_size();
+        size_t pages = size / page;
+        std::vector<unsigned char> flags(pages);
+        if (::mincore(begin, size, flags.data()) != 0)
+        {
+            return 0;
+        }
+
+        size_t count = 0;
+        for (size_t i = 0; i < pages; )
+        {
+            size_t run = 0;
+            while (((i + run) < pages) && (flags[i + run] & 1))
+            {
+                ++run;
+            }
+            if (run > 0)
+            {
+                count += run;
+                if (!f(begin + i * page, run * page))
+                {
+                    break;
+                }
+            }
+            i += run + 1;
+        }
+        return count;
+    }
+
+    // Purges at least pages resident free pages, if there are that many. Anonymous 
+    // pages are simply dropped. Pages of a file are removed from the file too, or the
+    // kernel would write them back.
+    size_t release(size_t pages)
+    {
+        size_t page     = page_size();
+        size_t released = 0;
+        for_each_purgeable([&](uint8_t* begin, size_t size)
+        {
+            resident(begin, size, [&](uint8_t* run, size_t bytes)
+            {
+                bytes = std::min(bytes, (pages - released) * page);
+#ifdef MADV_REMOVE
+                int advice = m_anonymous ? MADV_DONTNEED : MADV_REMOVE;
+#else
+                int advice = MADV_DONTNEED;
+#endif
+                if (::madvise(run, bytes, advice) == 0)
+                {
+                    released += bytes / page;
+                }
+                return released < pages;
+            });
+            return released < pages;
+        });
+        return released;
+    }
+
+    // Replaces the pages with fresh zero pages. Returns false if they couldn't be mapped.
+    static bool remap(uint8_t* address, size_t size)
+    {
+        void* result = ::mmap(address, size, PROT_READ | PROT_WRITE, 
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        return result == address;
+    }
+
+private:
+    void*  m_mapping{};
+    size_t m_size{};
+    POOL*  m_pool{};
+    bool   m_anonymous{};
+    // Decay purging state: the pages made dirty in each recent epoch, and the number 
+    // of dirty pages left by the last purge().
+    std::chrono::milliseconds             m_decay{10'000};
+    std::chrono::steady_clock::time_point m_epoch_start{std::chrono::steady_clock::now()};
+    std::array<size_t, DECAY_EPOCHS>      m_backlog{};
+    size_t                                m_last_dirty{};
+};
+
+
+// Serves allocations from a fast pool in memory, and falls back to an overflow pool 
+// for large allocations which the caller has flagged as cold, when the fast pool is 
+// full. Typically the overflow pool is a MappedArena over a temporary file, so that
+// peak loads spill to disk instead of failing. Blocks from the overflow pool are 
+// advised as cold, which deactivates any of their pages which are still resident from
+// earlier use. free() works out which pool owns a pointer from its address. Both pools
+// must outlive this object.
+template <typename HOT, typename COLD>
+class TieredAllocator
+{
+public:
+    TieredAllocator(HOT& hot, COLD& cold, uint32_t cold_min_size)
+    : m_hot{hot}
+    , m_cold{cold}
+    , m_cold_min_size{cold_min_size}
+    {
+    }
+
+    void* alloc(uint32_t size, bool cold = false)
+    {
+        void* pointer = m_hot.alloc(size);
+        if ((pointer == nullptr) && cold && (size >= m_cold_min_size))
+        {
+            pointer = m_cold.alloc(size);
+            if (pointer != nullptr)
+            {
+                m_cold.advise_cold(pointer, size);
+            }
+        }
+        return pointer;
+    }
+
+    void free(void* pointer)
+    {
+        if (m_cold.contains(pointer))
+        {
+            m_cold.free(pointer);
+        }
+        else
+        {
+            m_hot.free(pointer);
+        }
+    }
+
+private:
+    HOT&     m_hot;
+    COLD&    m_cold;
+    uint32_t m_cold_min_size;
+};
+
+
+} // namespace ub {
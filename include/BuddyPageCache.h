@@ -0,0 +1,401 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2020 Alan Chambers (unicycle.bloke@gmail.com)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+///////////////////////////////////////////////////////////////////////////////
+#pragma once
+#include "BuddyAllocator.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <list>
+#include <map>
+#include <utility>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+
+namespace ub {
+
+
+enum class Eviction
+{
+    // Evicts the extent used least recently. Each hit moves its extent to the front.
+    Lru,
+    // Sweeps a hand around the extents, evicting the first which hasn't been hit since
+    // the hand last passed, and clearing the mark of those which have. Hits only set a
+    // mark, and an extent read once is evicted first, so a scan doesn't flush the cache.
+    Clock
+};
+
+
+// Caches pages of files in extents of a power of two pages, each held in one block of
+// the pool. A miss reads the whole run of missing pages, up to the next cached extent,
+// into a single extent with one call to preadv(). When the pool is full, extents are
+// evicted until the new one fits, and their blocks coalesce as usual, so room for a
+// large read can be made by evicting small extents. If even an empty cache can't hold
+// an extent, the read goes straight to the file. POSIX only, and not thread safe.
+//
+// The last byte of each block holds the order of the block after it, so each block is
+// asked for one byte short of its extent, and the extent's final byte is kept in its
+// record. An extent of 2^k pages then takes a block of 2^k pages, not 2^(k+1).
+//
+// The cache doesn't see writes to the files. Call invalidate() after writing to or
+// closing a file. The pool must outlive the cache, but may be shared with other users.
+template <typename POOL, Eviction EVICTION = Eviction::Clock, uint32_t PAGE = 4096>
+class BuddyPageCache
+{
+public:
+    static_assert((PAGE & (PAGE - 1)) == 0, "PAGE must be a power of two");
+    static_assert(POOL::order_of(PAGE - 1) <= POOL::MAX_ORDER, "The pool can't hold a page");
+
+    // The largest extent, in pages.
+    static constexpr uint32_t MAX_PAGES = (1U << POOL::MAX_ORDER) / PAGE;
+
+    // Hits and misses are counted for each extent a read touches.
+    struct Stats
+    {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        // Reads which went straight to the file because no extent could be made.
+        uint64_t bypasses;
+        uint64_t cached_bytes;
+    };
+
+    explicit BuddyPageCache(POOL& pool)
+    : m_pool{pool}
+    {
+    }
+
+    ~BuddyPageCache()
+    {
+        clear();
+    }
+
+    BuddyPageCache(const BuddyPageCache&) = delete;
+    BuddyPageCache& operator=(const BuddyPageCache&) = delete;
+
+    // As pread(): returns the number of bytes read, which is fewer than size only at
+    // the end of the file, or -1 with errno set.
+    ssize_t read(int fd, void* buffer, size_t size, uint64_t offset)
+    {
+        auto*  out  = static_cast<uint8_t*>(buffer);
+        size_t done = 0;
+        while (done < size)
+        {
+            uint64_t position = offset + done;
+            uint64_t page     = position / PAGE;
+            Extent*  extent   = find(fd, page);
+            if (extent != nullptr)
+            {
+                ++m_stats.hits;
+                touch(extent);
+            }
+            else
+            {
+                ++m_stats.misses;
+                uint64_t last = (offset + size - 1) / PAGE;
+                extent = load(fd, page, last - page + 1);
+                if (extent == nullptr)
+                {
+                    if (errno == 0)
+                    {
+                        break;
+                    }
+                    if (errno != ENOMEM)
+                    {
+                        return -1;
+                    }
+                    ++m_stats.bypasses;
+                    ssize_t result = direct(fd, out + done, size - done, position);
+                    return (result < 0) ? -1 : ssize_t(done + result);
+                }
+            }
+
+            uint64_t start = extent->first * PAGE;
+            if (position >= (start + extent->bytes))
+            {
+                break;
+            }
+            size_t count = std::min<uint64_t>(size - done, start + extent->bytes - position);
+            copy(*extent, uint32_t(position - start), out + done, count);
+            done += count;
+
+            // A short extent ends at the end of the file.
+            if (extent->bytes < (extent->pages * PAGE))
+            {
+                break;
+            }
+        }
+        return ssize_t(done);
+    }
+
+    // Drops every cached page of the file.
+    void invalidate(int fd)
+    {
+        auto it = m_index.lower_bound({fd, 0});
+        while ((it != m_index.end()) && (it->first.first == fd))
+        {
+            drop(it->second);
+            it = m_index.erase(it);
+        }
+    }
+
+    // Drops every cached page.
+    void clear()
+    {
+        for (auto& [key, extent]: m_index)
+        {
+            drop(extent);
+        }
+        m_index.clear();
+    }
+
+    const Stats& read_stats() const
+    {
+        return m_stats;
+    }
+
+private:
+    struct Extent
+    {
+        int       fd;
+        uint64_t  first;
+        uint32_t  pages;
+        // Fewer than pages * PAGE for the last extent of a file.
+        uint32_t  bytes;
+        uint8_t*  data;
+        uint8_t   last;
+        bool      referenced;
+    };
+
+    using Extents = std::list<Extent>;
+    using Key     = std::pair<int, uint64_t>;
+
+    // The extent which holds the page, if any.
+    Extent* find(int fd, uint64_t page)
+    {
+        auto it = m_index.upper_bound({fd, page});
+        if (it == m_index.begin())
+        {
+            return nullptr;
+        }
+        --it;
+        Extent& extent = *it->second;
+        return ((extent.fd == fd) && (page < (extent.first + extent.pages))) ? &extent : nullptr;
+    }
+
+    void touch(Extent* extent)
+    {
+        if constexpr (EVICTION == Eviction::Lru)
+        {
+            auto it = m_index.find({extent->fd, extent->first});
+            m_extents.splice(m_extents.begin(), m_extents, it->second);
+        }
+        else
+        {
+            extent->referenced = true;
+        }
+    }
+
+    // Reads up to wanted pages from the first into a new extent. The extent stops short
+    // of the next cached extent, and is rounded to a power of two pages so that none of
+    // its block is wasted. Returns nullptr with errno set if the read fails, to ENOMEM
+    // if there is no room even with the cache empty, or to zero if the first page is
+    // past the end of the file.
+    Extent* load(int fd, uint64_t first, uint64_t wanted)
+    {
+        uint64_t room = MAX_PAGES;
+        auto     next = m_index.upper_bound({fd, first});
+        if ((next != m_index.end()) && (next->first.first == fd))
+        {
+            room = std::min(room, next->first.second - first);
+        }
+
+        uint32_t pages = 1;
+        while ((pages < wanted) && ((pages * 2) <= room))
+        {
+            pages *= 2;
+        }
+
+        uint8_t* data = allocate(pages);
+        if (data == nullptr)
+        {
+            errno = ENOMEM;
+            return nullptr;
+        }
+
+        Extent extent{fd, first, pages, 0, data, 0, false};
+        bool filled = fill(extent);
+        if (!filled || (extent.bytes == 0))
+        {
+            int error = filled ? 0 : errno;
+            m_pool.free(data, pages * PAGE - 1);
+            errno = error;
+            return nullptr;
+        }
+
+        // New extents go in front of the LRU list, or just behind the clock hand, where
+        // they are the last to be swept.
+        auto at = (EVICTION == Eviction::Lru) ? m_extents.begin() : m_hand;
+        auto it = m_extents.insert(at, extent);
+        m_index.emplace(Key{fd, first}, it);
+        m_stats.cached_bytes += pages * PAGE;
+        return &*it;
+    }
+
+    uint8_t* allocate(uint32_t pages)
+    {
+        for (;;)
+        {
+            if (void* data = m_pool.alloc(pages * PAGE - 1))
+            {
+                return static_cast<uint8_t*>(data);
+            }
+            if (!evict())
+            {
+                return nullptr;
+            }
+        }
+    }
+
+    bool evict()
+    {
+        if (m_extents.empty())
+        {
+            return false;
+        }
+
+        typename Extents::iterator victim;
+        if constexpr (EVICTION == Eviction::Lru)
+        {
+            victim = std::prev(m_extents.end());
+        }
+        else
+        {
+            for (;;)
+            {
+                if (m_hand == m_extents.end())
+                {
+                    m_hand = m_extents.begin();
+                }
+                if (!m_hand->referenced)
+                {
+                    break;
+                }
+                m_hand->referenced = false;
+                ++m_hand;
+            }
+            victim = m_hand;
+        }
+
+        ++m_stats.evictions;
+        m_index.erase({victim->fd, victim->first});
+        drop(victim);
+        return true;
+    }
+
+    void drop(typename Extents::iterator it)
+    {
+        m_pool.free(it->data, it->pages * PAGE - 1);
+        m_stats.cached_bytes -= it->pages * PAGE;
+        if (m_hand == it)
+        {
+            ++m_hand;
+        }
+        m_extents.erase(it);
+    }
+
+    // Reads the extent's pages, stopping short at the end of the file. Retries short
+    // reads, which are allowed even for regular files.
+    static bool fill(Extent& extent)
+    {
+        uint32_t size = extent.pages * PAGE;
+        uint32_t done = 0;
+        while (done < size)
+        {
+            iovec parts[2];
+            int   count = 0;
+            if (done < (size - 1))
+            {
+                parts[count++] = {extent.data + done, size - 1 - done};
+            }
+            parts[count++] = {&extent.last, 1};
+
+            ssize_t result = ::preadv(extent.fd, parts, count, off_t(extent.first * PAGE + done));
+            if (result < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return false;
+            }
+            if (result == 0)
+            {
+                break;
+            }
+            done += uint32_t(result);
+        }
+        extent.bytes = done;
+        return true;
+    }
+
+    static void copy(const Extent& extent, uint32_t from, uint8_t* out, size_t count)
+    {
+        uint32_t split = extent.pages * PAGE - 1;
+        size_t   head  = (from < split) ? std::min<size_t>(count, split - from) : 0;
+        std::memcpy(out, extent.data + from, head);
+        if (head < count)
+        {
+            out[head] = extent.last;
+        }
+    }
+
+    static ssize_t direct(int fd, uint8_t* out, size_t size, uint64_t offset)
+    {
+        size_t done = 0;
+        while (done < size)
+        {
+            ssize_t result = ::pread(fd, out + done, size - done, off_t(offset + done));
+            if (result < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return -1;
+            }
+            if (result == 0)
+            {
+                break;
+            }
+            done += size_t(result);
+        }
+        return ssize_t(done);
+    }
+
+private:
+    POOL&                                        m_pool;
+    Extents                                      m_extents;
+    std::map<Key, typename Extents::iterator>    m_index;
+    typename Extents::iterator                   m_hand{m_extents.end()};
+    Stats                                        m_stats{};
+};
+
+
+} // namespace ub {
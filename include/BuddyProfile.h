@@ -0,0 +1,145 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2020 Alan Chambers (unicycle.bloke@gmail.com)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+///////////////////////////////////////////////////////////////////////////////
+#pragma once
+#include "BuddyAllocator.h"
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <ostream>
+#include <vector>
+
+
+namespace ub {
+
+
+// Writes the heap profiler's samples in the legacy text format understood by pprof 
+// (as written by gperftools): one line per stack with the live and cumulative objects
+// and bytes, followed by the process mappings for symbolisation. pprof scales the 
+// samples back up using the interval in the header. Must be serialised with alloc() 
+// and free().
+//
+//     pprof --text ./app heap.prof
+template <typename POOL>
+void write_heap_profile(std::ostream& os, const POOL& pool)
+{
+    uint32_t live_count  = 0;
+    uint64_t live_bytes  = 0;
+    uint32_t total_count = 0;
+    uint64_t total_bytes = 0;
+    pool.for_each_sampled_stack([&](const typename POOL::SampledStack& s)
+    {
+        live_count  += s.live_count;
+        live_bytes  += s.live_bytes;
+        total_count += s.total_count;
+        total_bytes += s.total_bytes;
+    });
+
+    os << "heap profile: " << live_count << ": " << live_bytes << " [" << total_count << ": " 
+       << total_bytes << "] @ heap_v2/" << POOL::SAMPLE_INTERVAL << '\n';
+
+    pool.for_each_sampled_stack([&](const typename POOL::SampledStack& s)
+    {
+        os << s.live_count << ": " << s.live_bytes << " [" << s.total_count << ": " << s.total_bytes << "] @";
+        for (uint8_t i = 0; i < s.depth; ++i)
+        {
+            os << ' ' << s.frames[i];
+        }
+        os << '\n';
+    });
+
+    // pprof needs the mappings to relate addresses to binaries.
+    os << "\nMAPPED_LIBRARIES:\n";
+    std::ifstream maps{"/proc/self/maps"};
+    if (maps)
+    {
+        os << maps.rdbuf();
+    }
+}
+
+
+// Writes the heap profiler's samples as a human readable list of stacks, largest live
+// bytes first. The figures are the raw samples, not scaled up as pprof would. Frames
+// are symbolised if the platform supports it. Must be serialised with alloc() and free().
+template <typename POOL>
+void write_text_profile(std::ostream& os, const POOL& pool)
+{
+    std::vector<const typename POOL::SampledStack*> stacks;
+    pool.for_each_sampled_stack([&](const typename POOL::SampledStack& s)
+    {
+        stacks.push_back(&s);
+    });
+    std::sort(stacks.begin(), stacks.end(), [](auto a, auto b) { return a->live_bytes > b->live_bytes; });
+
+    os << "Sampled every " << POOL::SAMPLE_INTERVAL << " bytes on average\n";
+    for (auto s: stacks)
+    {
+        os << "\nlive " << s->live_bytes << " bytes in " << s->live_count << " blocks, cumulative " 
+           << s->total_bytes << " bytes in " << s->total_count << " blocks\n";
+
+#if __has_include(<execinfo.h>)
+        char** symbols = ::backtrace_symbols(s->frames, s->depth);
+#else
+        char** symbols = nullptr;
+#endif
+        for (uint8_t i = 0; i < s->depth; ++i)
+        {
+            os << "    ";
+            if (symbols != nullptr)
+            {
+                os << symbols[i] << '\n';
+            }
+            else
+            {
+                os << s->frames[i] << '\n';
+            }
+        }
+        std::free(symbols);
+    }
+}
+
+
+// Writes the result of blame() for a request of size bytes: the most nearly free 
+// regions of the size needed and the live allocations which stop each of them from 
+// coalescing. Must be serialised with alloc() and free(), and the pool needs 
+// BuddyTraits::STATS.
+template <typename POOL>
+void write_blame_report(std::ostream& os, const POOL& pool, uint32_t size, uint8_t max_regions = 3)
+{
+    auto stats = pool.read_stats();
+    os << "Request for " << size << " bytes: " << stats.free_bytes << " of " << (1U << POOL::MAX_ORDER) 
+       << " bytes free in the pool\n";
+
+    const void* region = nullptr;
+    pool.blame(size, max_regions, [&](const typename POOL::BlameRegion& r, const typename POOL::Blocker& b)
+    {
+        if (r.base != region)
+        {
+            region = r.base;
+            os << "\nregion " << r.base << ": " << r.used_bytes << " bytes in use\n";
+        }
+        os << "    " << b.pointer << ' ' << b.bytes << " bytes, tag " << b.tag;
+        if (b.aged)
+        {
+            os << ", age " << b.age;
+        }
+        os << '\n';
+    });
+}
+
+
+} // namespace ub {
@@ -0,0 +1,139 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2020 Alan Chambers (unicycle.bloke@gmail.com)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+///////////////////////////////////////////////////////////////////////////////
+#pragma once
+#include "BuddyAllocator.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+
+
+namespace ub {
+
+
+// Writes a snapshot of the pool's counters in the Prometheus text exposition format.
+// The name is used as the value of a "pool" label so that several pools can share
+// a file. Only reads the stats, so this can run on a monitoring thread while other
+// threads use the pool. The pool needs BuddyTraits::STATS.
+template <typename POOL>
+void write_prometheus(std::ostream& os, const POOL& pool, const char* name)
+{
+    const auto stats = pool.read_stats();
+
+    auto per_order = [&](const char* metric, const char* type, const char* help, auto field)
+    {
+        os << "# HELP " << metric << ' ' << help << '\n';
+        os << "# TYPE " << metric << ' ' << type << '\n';
+        for (uint8_t i = 0; i < POOL::ORDERS; ++i)
+        {
+            os << metric << "{pool=\"" << name << "\",order=\"" << unsigned(POOL::MIN_ORDER + i) << "\"} "
+               << stats.orders[i].*field << '\n';
+        }
+    };
+
+    auto single = [&](const char* metric, const char* type, const char* help, uint32_t value)
+    {
+        os << "# HELP " << metric << ' ' << help << '\n';
+        os << "# TYPE " << metric << ' ' << type << '\n';
+        os << metric << "{pool=\"" << name << "\"} " << value << '\n';
+    };
+
+    using OrderStats = typename POOL::OrderStats;
+    per_order("buddy_allocs_total", "counter", "Blocks allocated, by order.", &OrderStats::allocs);
+    per_order("buddy_frees_total", "counter", "Blocks freed, by order.", &OrderStats::frees);
+    per_order("buddy_free_blocks", "gauge", "Blocks in the free lists, by order.", &OrderStats::free_blocks);
+    per_order("buddy_capped_total", "counter", "Requests refused by an occupancy cap, by order.", &OrderStats::capped);
+    single("buddy_pool_bytes", "gauge", "Size of the pool.", 1U << POOL::MAX_ORDER);
+    single("buddy_used_bytes", "gauge", "Bytes in allocated blocks.", stats.used_bytes);
+    single("buddy_free_bytes", "gauge", "Bytes in free blocks.", stats.free_bytes);
+    single("buddy_failures_total", "counter", "Allocation requests which could not be satisfied.", stats.failures);
+}
+
+
+// Periodically rewrites a file with write_prometheus(), e.g. for the node_exporter
+// textfile collector. The file is written to a temporary and renamed so that the
+// scraper never sees a partial file. The pool must outlive the dumper.
+template <typename POOL>
+class PrometheusDumper
+{
+public:
+    PrometheusDumper(const POOL& pool, std::string name, std::string path, std::chrono::milliseconds period)
+    : m_pool{pool}
+    , m_name{std::move(name)}
+    , m_path{std::move(path)}
+    , m_period{period}
+    , m_thread{[this]{ run(); }}
+    {
+    }
+
+    ~PrometheusDumper()
+    {
+        {
+            std::lock_guard<std::mutex> lock{m_mutex};
+            m_stop = true;
+        }
+        m_cv.notify_one();
+        m_thread.join();
+    }
+
+    PrometheusDumper(const PrometheusDumper&) = delete;
+    PrometheusDumper& operator=(const PrometheusDumper&) = delete;
+
+    // Writes the file immediately. Also called from the dumper thread.
+    bool dump() const
+    {
+        std::string temp = m_path + ".tmp";
+        {
+            std::ofstream os{temp, std::ios::trunc};
+            write_prometheus(os, m_pool, m_name.c_str());
+            if (!os)
+            {
+                return false;
+            }
+        }
+        return std::rename(temp.c_str(), m_path.c_str()) == 0;
+    }
+
+private:
+    void run()
+    {
+        std::unique_lock<std::mutex> lock{m_mutex};
+        while (!m_cv.wait_for(lock, m_period, [this]{ return m_stop; }))
+        {
+            dump();
+        }
+    }
+
+private:
+    const POOL&               m_pool;
+    std::string               m_name;
+    std::string               m_path;
+    std::chrono::milliseconds m_period;
+    std::mutex                m_mutex;
+    std::condition_variable   m_cv;
+    bool                      m_stop{};
+    // Declared last so that everything else is initialised before the thread starts.
+    std::thread               m_thread;
+};
+
+
+} // namespace ub {
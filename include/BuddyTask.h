@@ -0,0 +1,218 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2020 Alan Chambers (unicycle.bloke@gmail.com)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+///////////////////////////////////////////////////////////////////////////////
+#pragma once
+#include "BuddyAllocator.h"
+#include <algorithm>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+
+namespace ub {
+
+
+template <typename SIGNATURE, typename POOL, size_t INLINE = 3 * sizeof(void*)>
+class BuddyTask;
+
+
+// A move-only callable holder, like std::function without the copy, for posting work
+// to an executor. A closure of up to INLINE bytes is held inside the task. A larger
+// one is held in a block from the pool, whose order is fixed by the closure's type
+// and checked at compile time, and is given back with the sized free() when the task
+// is destroyed, so no order byte is read. Each closure type has a single static table
+// of functions, as with AnyBuddyAllocator.
+//
+//     using Task = ub::BuddyTask<void(), ub::BuddyAllocator<20>>;
+//     Task task{pool, [big = std::array<int, 64>{}]{ ... }};
+//     task();
+//
+// Throws std::bad_alloc if the pool is exhausted. The pool must outlive the task.
+template <typename R, typename... ARGS, typename POOL, size_t INLINE>
+class BuddyTask<R(ARGS...), POOL, INLINE>
+{
+public:
+    BuddyTask() = default;
+
+    template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, BuddyTask>>>
+    BuddyTask(POOL& pool, F&& f)
+    : m_pool{&pool}
+    {
+        using Closure = std::decay_t<F>;
+        static_assert(std::is_invocable_r_v<R, Closure&, ARGS...>);
+
+        if constexpr (is_inline<Closure>())
+        {
+            new (m_storage.bytes) Closure(std::forward<F>(f));
+        }
+        else
+        {
+            static_assert(POOL::order_of(sizeof(Closure)) <= POOL::MAX_ORDER, "Closure is too large for the pool");
+            static_assert(alignof(Closure) <= std::min(POOL::BLOCK_ALIGNMENT, size_t{1} << POOL::order_of(sizeof(Closure))),
+                "Closure is more strictly aligned than the pool's blocks");
+
+            void* block = pool.alloc(sizeof(Closure));
+            if (block == nullptr)
+            {
+                throw std::bad_alloc{};
+            }
+            try
+            {
+                m_storage.block = new (block) Closure(std::forward<F>(f));
+            }
+            catch (...)
+            {
+                pool.free(block, sizeof(Closure));
+                throw;
+            }
+        }
+        m_table = &TABLE<Closure>;
+    }
+
+    BuddyTask(BuddyTask&& other) noexcept
+    : m_pool{other.m_pool}
+    {
+        take(other);
+    }
+
+    BuddyTask& operator=(BuddyTask&& other) noexcept
+    {
+        if (this != &other)
+        {
+            reset();
+            m_pool = other.m_pool;
+            take(other);
+        }
+        return *this;
+    }
+
+    ~BuddyTask()
+    {
+        reset();
+    }
+
+    // Empty if made by default, moved from or reset.
+    explicit operator bool() const
+    {
+        return m_table != nullptr;
+    }
+
+    // True if the closure is held in a block from the pool rather than in the task.
+    bool pooled() const
+    {
+        return (m_table != nullptr) && m_table->pooled;
+    }
+
+    R operator()(ARGS... args)
+    {
+        return m_table->invoke(m_storage, std::forward<ARGS>(args)...);
+    }
+
+    // Destroys the closure, returning its block to the pool if it had one.
+    void reset()
+    {
+        if (m_table != nullptr)
+        {
+            m_table->destroy(m_storage, *m_pool);
+            m_table = nullptr;
+        }
+    }
+
+private:
+    union Storage
+    {
+        alignas(std::max_align_t) unsigned char bytes[INLINE];
+        void* block;
+    };
+
+    struct Table
+    {
+        R    (*invoke)(Storage& storage, ARGS&&... args);
+        void (*move)(Storage& from, Storage& to);
+        void (*destroy)(Storage& storage, POOL& pool);
+        bool pooled;
+    };
+
+    // Inline closures are moved when the task is, so they mustn't throw.
+    template <typename F>
+    static constexpr bool is_inline()
+    {
+        return (sizeof(F) <= INLINE) && (alignof(F) <= alignof(std::max_align_t)) &&
+            std::is_nothrow_move_constructible_v<F>;
+    }
+
+    template <typename F>
+    static F& closure(Storage& storage)
+    {
+        if constexpr (is_inline<F>())
+        {
+            return *std::launder(reinterpret_cast<F*>(storage.bytes));
+        }
+        else
+        {
+            return *static_cast<F*>(storage.block);
+        }
+    }
+
+    template <typename F>
+    static constexpr Table TABLE
+    {
+        [](Storage& storage, ARGS&&... args) -> R
+        {
+            return static_cast<R>(closure<F>(storage)(std::forward<ARGS>(args)...));
+        },
+        [](Storage& from, Storage& to)
+        {
+            if constexpr (is_inline<F>())
+            {
+                new (to.bytes) F(std::move(closure<F>(from)));
+                closure<F>(from).~F();
+            }
+            else
+            {
+                to.block = from.block;
+            }
+        },
+        [](Storage& storage, POOL& pool)
+        {
+            closure<F>(storage).~F();
+            if constexpr (!is_inline<F>())
+            {
+                pool.free(storage.block, sizeof(F));
+            }
+        },
+        !is_inline<F>()
+    };
+
+    void take(BuddyTask& other)
+    {
+        if (other.m_table != nullptr)
+        {
+            other.m_table->move(other.m_storage, m_storage);
+            m_table = std::exchange(other.m_table, nullptr);
+        }
+    }
+
+private:
+    const Table* m_table{};
+    POOL*        m_pool{};
+    Storage      m_storage;
+};
+
+
+} // namespace ub {
@@ -0,0 +1,223 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2020 Alan Chambers (unicycle.bloke@gmail.com)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+///////////////////////////////////////////////////////////////////////////////
+#pragma once
+#include <type_traits>
+#include <cstdint>
+#include <array>
+#include <limits>
+
+
+namespace ub {
+
+
+// A buddy allocator which can be used in constant expressions, so that tables, trees
+// and other linked structures can be built at compile time and placed in read-only
+// memory. BuddyAllocator can't do this because it keeps its free lists and metadata
+// inside the pool, which needs reinterpret_cast. This version works entirely with
+// indices: the pool is an array of 1 << MAX_POWER elements of T, allocations are runs
+// of elements identified by the index of the first, and the free lists and orders are
+// held in separate arrays. The splitting and coalescing are the same.
+//
+//     constexpr auto make_list()
+//     {
+//         ub::ConstexprBuddyAllocator<6, Node> pool;
+//         auto head = pool.alloc(1);
+//         pool[head] = Node{...};
+//         ...
+//         return pool;
+//     }
+//     constexpr auto list = make_list();
+//
+// T must be a literal type with a constexpr default constructor. The metadata costs
+// 1 + 2 * sizeof(Index) bytes per element, which doesn't matter much at compile time
+// but makes this a poor choice for large pools at run time.
+template <uint8_t MAX_POWER, typename T = uint8_t>
+class ConstexprBuddyAllocator
+{
+public:
+    static constexpr uint8_t  MIN_ORDER = 0;
+    static constexpr uint8_t  MAX_ORDER = MAX_POWER;
+    static constexpr uint8_t  ORDERS    = MAX_ORDER - MIN_ORDER + 1;
+    static constexpr uint32_t SIZE      = 1U << MAX_ORDER;
+
+    static_assert(MAX_ORDER < 32);
+
+    // The smallest unsigned type which can hold any index, plus a null value.
+    using Index = std::conditional_t<(MAX_ORDER < 8), uint8_t,
+                  std::conditional_t<(MAX_ORDER < 16), uint16_t, uint32_t>>;
+    static constexpr Index NULL_INDEX = std::numeric_limits<Index>::max();
+
+    constexpr ConstexprBuddyAllocator()
+    {
+        // The base state is a single large block which will be sub-divided as
+        // allocations are made.
+        push(0, MAX_ORDER);
+    }
+
+    // Returns the index of a run of elements whose length is the smallest power of two
+    // which holds count, or NULL_INDEX if the request can't be satisfied.
+    constexpr Index alloc(uint32_t count)
+    {
+        uint8_t order = log2(count);
+        if ((count == 0) || (order > MAX_ORDER))
+        {
+            return NULL_INDEX;
+        }
+
+        // Find the first free block we can use, it may be larger than we need.
+        uint8_t index = order;
+        while ((m_freelists[index] == NULL_INDEX) && (index < MAX_ORDER))
+        {
+            ++index;
+        }
+        if (m_freelists[index] == NULL_INDEX)
+        {
+            return NULL_INDEX;
+        }
+
+        // Store any buddies in the relevant free lists.
+        Index block = m_freelists[index];
+        remove(block, index);
+        while (index > order)
+        {
+            --index;
+            push(block ^ (1U << index), index);
+        }
+
+        m_orders[block] = ALLOCATED | order;
+        return block;
+    }
+
+    constexpr void free(Index block)
+    {
+        if (block == NULL_INDEX)
+        {
+            return;
+        }
+
+        uint8_t order = m_orders[block] & ~ALLOCATED;
+        m_orders[block] = 0;
+
+        // Coalesce with the buddy for as long as it is free. The orders array says
+        // directly whether it is, so there's no need to search the free list.
+        while (order < MAX_ORDER)
+        {
+            Index buddy = block ^ (1U << order);
+            if (m_orders[buddy] != (FREE | order))
+            {
+                break;
+            }
+            remove(buddy, order);
+            block = (block < buddy) ? block : buddy;
+            ++order;
+        }
+        push(block, order);
+    }
+
+    // The number of elements in the run starting at block, which may be more than
+    // was requested.
+    constexpr uint32_t capacity(Index block) const
+    {
+        return 1U << (m_orders[block] & ~ALLOCATED);
+    }
+
+    constexpr T& operator[](Index index)
+    {
+        return m_buffer[index];
+    }
+
+    constexpr const T& operator[](Index index) const
+    {
+        return m_buffer[index];
+    }
+
+    constexpr const T* data() const
+    {
+        return m_buffer.data();
+    }
+
+private:
+    static constexpr uint8_t log2(uint32_t size)
+    {
+        uint8_t result = 0;
+        while ((1U << result) < size)
+        {
+            ++result;
+        }
+        return result;
+    }
+
+    // The free lists are doubly linked through arrays of indices, so that a buddy can
+    // be removed without searching.
+    constexpr void push(Index block, uint8_t order)
+    {
+        Index head = m_freelists[order];
+        m_next[block] = head;
+        m_prev[block] = NULL_INDEX;
+        if (head != NULL_INDEX)
+        {
+            m_prev[head] = block;
+        }
+        m_freelists[order] = block;
+        m_orders[block] = FREE | order;
+    }
+
+    constexpr void remove(Index block, uint8_t order)
+    {
+        Index next = m_next[block];
+        Index prev = m_prev[block];
+        if (next != NULL_INDEX)
+        {
+            m_prev[next] = prev;
+        }
+        if (prev != NULL_INDEX)
+        {
+            m_next[prev] = next;
+        }
+        else
+        {
+            m_freelists[order] = next;
+        }
+        m_orders[block] = 0;
+    }
+
+    static constexpr std::array<Index, ORDERS> empty_lists()
+    {
+        std::array<Index, ORDERS> lists{};
+        for (auto& list: lists)
+        {
+            list = NULL_INDEX;
+        }
+        return lists;
+    }
+
+private:
+    // The state of the block starting at each element: zero if no block starts there,
+    // otherwise a flag for free or allocated, and the order.
+    static constexpr uint8_t FREE      = 0x40;
+    static constexpr uint8_t ALLOCATED = 0x80;
+
+    std::array<Index, ORDERS> m_freelists{empty_lists()};
+    std::array<Index, SIZE>   m_next{};
+    std::array<Index, SIZE>   m_prev{};
+    std::array<uint8_t, SIZE> m_orders{};
+    std::array<T, SIZE>       m_buffer{};
+};
+
+
+} // namespace ub {
@@ -18,10 +18,24 @@
 #define CATCH_CONFIG_MAIN  // This tells Catch to provide a main() - only do this in one cpp file
 #include "catch2/catch.hpp"
 #include "include/BuddyAllocator.h"
+#include "include/BuddyStats.h"
+#include "include/BuddyProfile.h"
+#include "include/ConstexprBuddyAllocator.h"
+#include "include/AnyBuddyAllocator.h"
+#include "include/BuddyTask.h"
+#if __has_include(<sys/mman.h>)
+#include "include/BuddyMappedArena.h"
+#include "include/BuddyPageCache.h"
+#endif
 #include <iostream>
 #include <vector>
 #include <cstdlib>
 #include <algorithm>
+#include <sstream>
+#include <numeric>
+#include <fstream>
+#include <filesystem>
+#include <thread>
 
 
 TEST_CASE("Fixed allocation until exhaustion", "[Buddy]") 
@@ -167,3 +181,1439 @@ TEST_CASE("Random allocation till exhausation", "[Buddy]")
 }
 
 
+// The stats are off by default, and most of the tests below check their work with them.
+struct CountedTraits : ub::BuddyTraits
+{
+    static constexpr bool STATS = true;
+};
+
+
+TEST_CASE("Stats track allocations and frees", "[Buddy]") 
+{
+    constexpr uint8_t MAX_ORDER = 10; // => 1KB
+    ub::BuddyAllocator<MAX_ORDER, 8, CountedTraits> pool;
+    using Pool = decltype(pool);
+
+    auto stats = pool.read_stats();
+    CHECK(stats.used_bytes == 0);
+    CHECK(stats.free_bytes == (1U << MAX_ORDER));
+    CHECK(stats.orders[Pool::ORDERS - 1].free_blocks == 1);
+
+    // A single minimum sized block splits every order on the way down.
+    void* p = pool.alloc(1);
+    stats = pool.read_stats();
+    CHECK(stats.used_bytes == (1U << Pool::MIN_ORDER));
+    CHECK(stats.free_bytes == (1U << MAX_ORDER) - (1U << Pool::MIN_ORDER));
+    CHECK(stats.orders[0].allocs == 1);
+    for (uint8_t i = 0; i < Pool::ORDERS - 1; ++i)
+    {
+        CHECK(stats.orders[i].free_blocks == 1);
+    }
+    CHECK(stats.orders[Pool::ORDERS - 1].free_blocks == 0);
+
+    CHECK(pool.alloc(1U << MAX_ORDER) == nullptr);
+    CHECK(pool.read_stats().failures == 1);
+
+    // Freeing coalesces everything back into the top level block.
+    pool.free(p);
+    stats = pool.read_stats();
+    CHECK(stats.orders[0].frees == 1);
+    CHECK(stats.used_bytes == 0);
+    CHECK(stats.orders[Pool::ORDERS - 1].free_blocks == 1);
+    for (uint8_t i = 0; i < Pool::ORDERS - 1; ++i)
+    {
+        CHECK(stats.orders[i].free_blocks == 0);
+    }
+
+    // Readers on another thread always see consistent figures.
+    std::atomic<bool> done{false};
+    std::thread reader{[&]
+    {
+        while (!done)
+        {
+            auto s = pool.read_stats();
+            if ((s.used_bytes + s.free_bytes) != (1U << MAX_ORDER))
+            {
+                done = true;
+            }
+        }
+    }};
+    for (uint32_t i = 0; i < 100'000; ++i)
+    {
+        pool.free(pool.alloc(1 + (i % 200)));
+    }
+    CHECK(!done);
+    done = true;
+    reader.join();
+
+    std::ostringstream os;
+    ub::write_prometheus(os, pool, "test");
+    CHECK(os.str().find("buddy_used_bytes{pool=\"test\"} 0\n") != std::string::npos);
+    CHECK(os.str().find("# TYPE buddy_allocs_total counter") != std::string::npos);
+
+    std::string path = (std::filesystem::temp_directory_path() / "buddy_test.prom").string();
+    {
+        ub::PrometheusDumper<Pool> dumper{pool, "test", path, std::chrono::hours{1}};
+        CHECK(dumper.dump());
+    }
+    std::ifstream is{path};
+    CHECK(std::string{std::istreambuf_iterator<char>{is}, {}} == os.str());
+    std::remove(path.c_str());
+}
+
+
+struct TaggedTraits : CountedTraits
+{
+    static constexpr uint16_t MAX_TAGS = 4;
+};
+
+
+TEST_CASE("Tagged allocations are accounted per tag", "[Buddy]") 
+{
+    constexpr uint8_t MAX_ORDER = 12; // => 4KB
+    ub::BuddyAllocator<MAX_ORDER, 8, TaggedTraits> pool;
+    using Pool = decltype(pool);
+
+    void* a = pool.alloc(100, 1);
+    void* b = pool.alloc(10, 1);
+    void* c = pool.alloc(500, 2);
+    // Tags are reduced modulo MAX_TAGS, so 6 is the same as 2.
+    void* d = pool.alloc(1, 6);
+    void* e = pool.alloc(1, ub::site_tag("test.cpp", 42));
+
+    CHECK(pool.read_tag_stats(1).live_count == 2);
+    CHECK(pool.read_tag_stats(1).live_bytes == 128 + std::max(16U, 1U << Pool::MIN_ORDER));
+    CHECK(pool.read_tag_stats(2).live_count == 2);
+    CHECK(pool.read_tag_stats(2).live_bytes == 512 + (1U << Pool::MIN_ORDER));
+    CHECK(pool.read_tag_stats(ub::site_tag("test.cpp", 42) % 4 + 4).live_count == 1);
+    CHECK(pool.read_tag_stats(3).live_count + pool.read_tag_stats(0).live_count + 
+          pool.read_tag_stats(1).live_count + pool.read_tag_stats(2).live_count == 5);
+
+    pool.free(a);
+    pool.free(c);
+    pool.free(e);
+    CHECK(pool.read_tag_stats(1).live_count == 1);
+    CHECK(pool.read_tag_stats(2).live_bytes == (1U << Pool::MIN_ORDER));
+
+    pool.free(b);
+    pool.free(d);
+    for (uint16_t tag = 0; tag < Pool::MAX_TAGS; ++tag)
+    {
+        CHECK(pool.read_tag_stats(tag).live_count == 0);
+        CHECK(pool.read_tag_stats(tag).live_bytes == 0);
+    }
+    CHECK(pool.read_stats().used_bytes == 0);
+}
+
+
+struct SampledTraits : CountedTraits
+{
+    static constexpr uint32_t SAMPLE_INTERVAL = 1024;
+};
+
+
+struct SampledAgesTraits : SampledTraits
+{
+    static constexpr Ages AGES = Ages::Sampled;
+};
+
+
+TEST_CASE("Heap profiler samples allocations by stack", "[Buddy]") 
+{
+    constexpr uint8_t MAX_ORDER = 16; // => 64KB
+    ub::BuddyAllocator<MAX_ORDER, 8, SampledTraits> pool;
+    using Pool = decltype(pool);
+
+    auto sampled = [&]
+    {
+        uint32_t live = 0;
+        uint32_t total = 0;
+        pool.for_each_sampled_stack([&](const Pool::SampledStack& s)
+        {
+            live  += s.live_count;
+            total += s.total_count;
+        });
+        return std::make_pair(live, total);
+    };
+
+    // Roughly one sample per KB allocated.
+    std::vector<void*> blocks;
+    for (uint32_t i = 0; i < 1000; ++i)
+    {
+        blocks.push_back(pool.alloc(63));
+    }
+    auto [live, total] = sampled();
+    CHECK(live == total);
+    CHECK(live > 20);
+    CHECK(live < 200);
+
+    std::ostringstream heap;
+    ub::write_heap_profile(heap, pool);
+    CHECK(heap.str().rfind("heap profile: " + std::to_string(live) + ": " + std::to_string(live * 64), 0) == 0);
+    CHECK(heap.str().find("@ heap_v2/1024\n") != std::string::npos);
+    CHECK(heap.str().find("MAPPED_LIBRARIES:") != std::string::npos);
+
+    std::ostringstream text;
+    ub::write_text_profile(text, pool);
+    CHECK(text.str().find("live " + std::to_string(live * 64) + " bytes") != std::string::npos);
+
+    // Freeing releases the live samples but keeps the cumulative totals.
+    for (auto block: blocks)
+    {
+        pool.free(block);
+    }
+    CHECK(sampled().first == 0);
+    CHECK(sampled().second == total);
+    CHECK(pool.read_stats().used_bytes == 0);
+
+    // Without tags or full ages, only the samples keep their orders, and only they have
+    // ages, so the ages still cover every live sample.
+    ub::BuddyAllocator<MAX_ORDER, 8, SampledAgesTraits> aged;
+    using Aged = decltype(aged);
+    for (uint32_t i = 0; i < 1000; ++i)
+    {
+        aged.alloc(63);
+    }
+    uint32_t samples = 0;
+    aged.for_each_sampled_stack([&](const Aged::SampledStack& s) { samples += s.live_count; });
+    uint32_t ages = 0;
+    aged.for_each_live_age([&](uint8_t order, uint16_t, uint32_t)
+    {
+        CHECK(order == 6);
+        ++ages;
+    });
+    CHECK(samples > 20);
+    CHECK(ages == samples);
+}
+
+
+struct AgedTraits : CountedTraits
+{
+    static constexpr uint16_t MAX_TAGS = 2;
+    static constexpr Ages     AGES     = Ages::Full;
+
+    static inline uint32_t clock = 0;
+    static uint32_t now() { return clock; }
+};
+
+
+TEST_CASE("Lifetimes are recorded by order and tag", "[Buddy]") 
+{
+    constexpr uint8_t MAX_ORDER = 12; // => 4KB
+    ub::BuddyAllocator<MAX_ORDER, 8, AgedTraits> pool;
+    using Pool = decltype(pool);
+
+    CHECK(Pool::age_bucket(0) == 0);
+    CHECK(Pool::age_bucket(1) == 1);
+    CHECK(Pool::age_bucket(3) == 2);
+    CHECK(Pool::age_bucket(4) == 3);
+    CHECK(Pool::age_bucket(0xFFFFFFFF) == Pool::AGE_BUCKETS - 1);
+
+    AgedTraits::clock = 1000;
+    void* short_lived = pool.alloc(100, 0);
+    void* long_lived  = pool.alloc(1000, 1);
+
+    AgedTraits::clock = 1005;
+    pool.free(short_lived);
+
+    // The long lived block shows up in the live walk but not the lifetimes.
+    AgedTraits::clock = 3000;
+    uint32_t live = 0;
+    pool.for_each_live_age([&](uint8_t order, uint16_t tag, uint32_t age)
+    {
+        CHECK(order == 10);
+        CHECK(tag == 1);
+        CHECK(age == 2000);
+        ++live;
+    });
+    CHECK(live == 1);
+
+    auto by_order = pool.read_lifetimes_by_order(7);
+    CHECK(by_order.counts[Pool::age_bucket(5)] == 1);
+    CHECK(std::accumulate(std::begin(by_order.counts), std::end(by_order.counts), 0U) == 1);
+    CHECK(pool.read_lifetimes_by_tag(0).counts[Pool::age_bucket(5)] == 1);
+
+    pool.free(long_lived);
+    CHECK(pool.read_lifetimes_by_order(10).counts[Pool::age_bucket(2000)] == 1);
+    CHECK(pool.read_lifetimes_by_tag(1).counts[Pool::age_bucket(2000)] == 1);
+
+    live = 0;
+    pool.for_each_live_age([&](uint8_t, uint16_t, uint32_t) { ++live; });
+    CHECK(live == 0);
+}
+
+
+TEST_CASE("Blame finds the allocations which prevent coalescing", "[Buddy]") 
+{
+    constexpr uint8_t MAX_ORDER = 12; // => 4KB
+    ub::BuddyAllocator<MAX_ORDER, 8, AgedTraits> pool;
+    using Pool = decltype(pool);
+
+    // Fill the pool with 256 byte blocks, then free all but a few, so that every 
+    // 1KB region has something in it.
+    AgedTraits::clock = 0;
+    std::vector<void*> blocks;
+    while (void* p = pool.alloc(255, 0))
+    {
+        blocks.push_back(p);
+    }
+    CHECK(blocks.size() == 16);
+
+    std::vector<void*> kept{blocks[0], blocks[1], blocks[5], blocks[10], blocks[12], blocks[13], blocks[14]};
+    for (auto p: blocks)
+    {
+        if (std::find(kept.begin(), kept.end(), p) == kept.end())
+        {
+            pool.free(p);
+        }
+    }
+    // A large block occupies the second region entirely.
+    pool.free(blocks[5]);
+    kept.erase(kept.begin() + 2);
+    void* big = pool.alloc(1000, 1);
+    REQUIRE(big != nullptr);
+
+    AgedTraits::clock = 50;
+    CHECK(pool.alloc(1023) == nullptr);
+
+    std::vector<std::pair<const void*, uint32_t>> regions;
+    std::vector<const void*> blockers;
+    pool.blame(1023, 2, [&](const Pool::BlameRegion& r, const Pool::Blocker& b)
+    {
+        if (regions.empty() || (regions.back().first != r.base))
+        {
+            regions.push_back({r.base, r.used_bytes});
+        }
+        CHECK(b.bytes == 256);
+        CHECK(b.aged);
+        CHECK(b.age == 50);
+        blockers.push_back(b.pointer);
+    });
+
+    // The third region has one block in use, the first two.
+    REQUIRE(regions.size() == 2);
+    CHECK(regions[0].second == 256);
+    CHECK(regions[1].second == 512);
+    CHECK(blockers == std::vector<const void*>{blocks[10], blocks[0], blocks[1]});
+
+    std::ostringstream os;
+    ub::write_blame_report(os, pool, 1023);
+    CHECK(os.str().find("256 bytes, tag 0, age 50") != std::string::npos);
+    CHECK(os.str().find("768 bytes in use") != std::string::npos);
+    CHECK(os.str().find("1024 bytes in use") == std::string::npos);
+
+    for (auto p: kept)
+    {
+        pool.free(p);
+    }
+    pool.free(big);
+    CHECK(pool.read_stats().used_bytes == 0);
+}
+
+
+TEST_CASE("Clusters allocate related objects together", "[Buddy]") 
+{
+    constexpr uint8_t MAX_ORDER = 12; // => 4KB
+    ub::BuddyAllocator<MAX_ORDER, 8, CountedTraits> pool;
+
+    auto objects = pool.alloc_cluster({24, 1, 100});
+    REQUIRE(std::all_of(objects.begin(), objects.end(), [](void* p) { return p != nullptr; }));
+
+    // One block, with each object aligned and after the previous one.
+    CHECK(pool.read_stats().orders[8 - pool.MIN_ORDER].allocs == 1);
+    for (size_t i = 0; i < objects.size(); ++i)
+    {
+        CHECK(reinterpret_cast<uintptr_t>(objects[i]) % 8 == 0);
+    }
+    auto o0 = static_cast<uint8_t*>(objects[0]);
+    auto o1 = static_cast<uint8_t*>(objects[1]);
+    auto o2 = static_cast<uint8_t*>(objects[2]);
+    CHECK(o1 >= o0 + 24);
+    CHECK(o2 >= o1 + 1);
+    CHECK(o2 - o0 < 64);
+    std::memset(o0, 1, 24);
+    std::memset(o1, 2, 1);
+    std::memset(o2, 3, 100);
+
+    // The block is only released when every object has been freed.
+    pool.free(o1);
+    pool.free(o0);
+    CHECK(pool.read_stats().used_bytes == 256);
+    CHECK(std::all_of(o2, o2 + 100, [](uint8_t b) { return b == 3; }));
+    pool.free(o2);
+    CHECK(pool.read_stats().used_bytes == 0);
+
+    // Or all at once.
+    objects = pool.alloc_cluster({8, 8, 8});
+    pool.free(objects[1]);
+    pool.free_cluster(objects[2]);
+    CHECK(pool.read_stats().used_bytes == 0);
+
+    CHECK(pool.alloc_cluster({4000, 100})[0] == nullptr);
+
+    // Sizes whose sum would wrap around are refused too.
+    auto failures = pool.read_stats().failures;
+    CHECK(pool.alloc_cluster({100, 0xFFFFFFF0U})[0] == nullptr);
+    CHECK(pool.read_stats().failures == failures + 1);
+    CHECK(pool.read_stats().used_bytes == 0);
+}
+
+
+TEST_CASE("Offsets can be used in place of pointers", "[Buddy]") 
+{
+    static_assert(std::is_same_v<ub::BuddyAllocator<8>::Offset, uint8_t>);
+    static_assert(std::is_same_v<ub::BuddyAllocator<16>::Offset, uint16_t>);
+    static_assert(std::is_same_v<ub::BuddyAllocator<17>::Offset, uint32_t>);
+
+    constexpr uint8_t MAX_ORDER = 12; // => 4KB
+    ub::BuddyAllocator<MAX_ORDER, 8, CountedTraits> pool;
+    using Pool = decltype(pool);
+
+    Pool::Offset a = pool.alloc_offset(100);
+    Pool::Offset b = pool.alloc_offset(100);
+    REQUIRE(a != Pool::NULL_OFFSET);
+    REQUIRE(b != Pool::NULL_OFFSET);
+    CHECK(a != b);
+    CHECK(pool.offset_from_ptr(pool.ptr_from_offset(a)) == a);
+
+    std::memset(pool.ptr_from_offset(a), 0xAA, 100);
+    std::memset(pool.ptr_from_offset(b), 0xBB, 100);
+    auto pb = static_cast<const uint8_t*>(std::as_const(pool).ptr_from_offset(b));
+    CHECK(std::all_of(pb, pb + 100, [](uint8_t x) { return x == 0xBB; }));
+
+    // Offsets and pointers are interchangeable.
+    pool.free(pool.ptr_from_offset(a));
+    pool.free_offset(b);
+    pool.free_offset(Pool::NULL_OFFSET);
+    CHECK(pool.read_stats().used_bytes == 0);
+
+    CHECK(pool.alloc_offset(1U << MAX_ORDER) == Pool::NULL_OFFSET);
+}
+
+
+TEST_CASE("Live allocations can be split and joined", "[Buddy]") 
+{
+    constexpr uint8_t MAX_ORDER = 12; // => 4KB
+    ub::BuddyAllocator<MAX_ORDER, 8, AgedTraits> pool;
+    using Pool = decltype(pool);
+
+    auto first = static_cast<uint8_t*>(pool.alloc(1000, 1));
+    std::memset(first, 7, 1000);
+
+    auto second = static_cast<uint8_t*>(pool.split(first));
+    REQUIRE(second == first + 512);
+    CHECK(pool.read_stats().used_bytes == 1024);
+    CHECK(pool.read_tag_stats(1).live_count == 2);
+    CHECK(pool.read_stats().orders[9 - Pool::MIN_ORDER].allocs == 2);
+    CHECK(std::all_of(second, second + 488, [](uint8_t b) { return b == 7; }));
+
+    // Quarter the second half, and then put it back together.
+    auto third = static_cast<uint8_t*>(pool.split(second));
+    REQUIRE(third == second + 256);
+    CHECK(pool.join(first, third) == nullptr);
+    CHECK(pool.join(third, second) == second);
+    CHECK(pool.join(first, second) == first);
+    CHECK(pool.read_stats().orders[10 - Pool::MIN_ORDER].allocs == 2);
+    CHECK(pool.read_tag_stats(1).live_count == 1);
+    CHECK(pool.read_tag_stats(1).live_bytes == 1024);
+    pool.free(first);
+    CHECK(pool.read_stats().used_bytes == 0);
+
+    // The halves are freed independently.
+    first  = static_cast<uint8_t*>(pool.alloc(1000, 1));
+    second = static_cast<uint8_t*>(pool.split(first));
+    pool.free(first);
+    CHECK(pool.read_stats().used_bytes == 512);
+    uint32_t live = 0;
+    pool.for_each_live_age([&](uint8_t order, uint16_t tag, uint32_t) 
+    { 
+        CHECK(order == 9);
+        CHECK(tag == 1);
+        ++live; 
+    });
+    CHECK(live == 1);
+    pool.free(second);
+    CHECK(pool.read_stats().used_bytes == 0);
+    CHECK(pool.read_tag_stats(1).live_bytes == 0);
+
+    // Minimum sized blocks and cluster members cannot be split.
+    void* small = pool.alloc(1);
+    CHECK(pool.split(small) == nullptr);
+    auto cluster = pool.alloc_cluster({100, 100});
+    CHECK(pool.split(cluster[0]) == nullptr);
+    CHECK(pool.join(cluster[0], cluster[1]) == nullptr);
+    pool.free(small);
+    pool.free_cluster(cluster[0]);
+    CHECK(pool.read_stats().used_bytes == 0);
+}
+
+
+TEST_CASE("Allocations can be resized", "[Buddy]") 
+{
+    constexpr uint8_t MAX_ORDER = 12; // => 4KB
+    ub::BuddyAllocator<MAX_ORDER, 8, TaggedTraits> pool;
+
+    auto first = static_cast<uint8_t*>(pool.realloc(nullptr, 100));
+    REQUIRE(first != nullptr);
+    CHECK(pool.capacity(first) == 127);
+    std::memset(first, 3, 100);
+
+    // Within the same order, and shrinking, stay in place.
+    CHECK(pool.realloc(first, 120) == first);
+    CHECK(pool.realloc(first, 50) == first);
+    CHECK(pool.capacity(first) == 63);
+    CHECK(pool.read_stats().used_bytes == 64);
+
+    // Growing moves, and keeps the contents and the tag.
+    auto tagged = static_cast<uint8_t*>(pool.alloc(50, 2));
+    std::memset(tagged, 9, 50);
+    auto grown = static_cast<uint8_t*>(pool.realloc(tagged, 1000));
+    REQUIRE(grown != nullptr);
+    CHECK(grown != tagged);
+    CHECK(std::all_of(grown, grown + 50, [](uint8_t b) { return b == 9; }));
+    CHECK(pool.read_tag_stats(2).live_bytes == 1024);
+    CHECK(pool.read_tag_stats(2).live_count == 1);
+
+    // A failed request leaves the original alone.
+    CHECK(pool.realloc(first, 3000) == nullptr);
+    CHECK(std::all_of(first, first + 50, [](uint8_t b) { return b == 3; }));
+
+    CHECK(pool.realloc(grown, 0) == nullptr);
+    pool.free(first);
+    CHECK(pool.read_stats().used_bytes == 0);
+}
+
+
+TEST_CASE("Range allocation returns the largest block available", "[Buddy]") 
+{
+    constexpr uint8_t MAX_ORDER = 12; // => 4KB
+    ub::BuddyAllocator<MAX_ORDER, 8, CountedTraits> pool;
+
+    // With an empty pool the top block is split down to the maximum.
+    uint32_t size = 0;
+    void* a = pool.alloc_range(100, 1000, size);
+    REQUIRE(a != nullptr);
+    CHECK(size == 1023);
+
+    // Leaves free blocks of 1KB and 2KB. Prefers the larger unsplit block
+    // when the maximum allows it.
+    void* b = pool.alloc_range(10, 4000, size);
+    CHECK(size == 2047);
+
+    // Only a 1KB block remains. A small request takes a 256 byte piece of it. 
+    void* c = pool.alloc_range(100, 200, size);
+    CHECK(size == 255);
+
+    // Without splitting, the 512 byte block is the largest available.
+    void* d = pool.alloc_range(300, 4000, size);
+    CHECK(size == 511);
+
+    // Now 256 bytes remain, which is too small.
+    CHECK(pool.alloc_range(300, 4000, size) == nullptr);
+    CHECK(size == 0);
+    void* e = pool.alloc_range(1, 4000, size);
+    CHECK(size == 255);
+
+    CHECK(pool.alloc_range(0, 100, size) == nullptr);
+    CHECK(pool.alloc_range(200, 100, size) == nullptr);
+    CHECK(pool.read_stats().free_bytes == 0);
+
+    for (void* p: {a, b, c, d, e})
+    {
+        pool.free(p);
+    }
+    CHECK(pool.read_stats().used_bytes == 0);
+
+    // Any maximum above the pool size means as large as possible.
+    void* f = pool.alloc_range(16, UINT32_MAX, size);
+    CHECK(size == 4095);
+    pool.free(f);
+    void* g = pool.alloc_range(16, 0x80000001U, size);
+    CHECK(size == 4095);
+    pool.free(g);
+    CHECK(pool.alloc_range(0x80000001U, UINT32_MAX, size) == nullptr);
+    CHECK(pool.read_stats().used_bytes == 0);
+}
+
+
+struct TwoEndedTraits : CountedTraits
+{
+    static constexpr Placement PLACEMENT   = Placement::TwoEnded;
+    static constexpr uint8_t   LARGE_ORDER = 12;
+};
+
+
+TEST_CASE("Two ended placement keeps small and large blocks apart", "[Buddy]") 
+{
+    constexpr uint8_t MAX_ORDER = 16; // => 64KB
+    ub::BuddyAllocator<MAX_ORDER, 8, TwoEndedTraits> pool;
+    auto base = static_cast<uint8_t*>(pool.ptr_from_offset(0));
+
+    // Small blocks fill from the bottom, large blocks from the top.
+    auto small = static_cast<uint8_t*>(pool.alloc(100));
+    auto large = static_cast<uint8_t*>(pool.alloc(5000));
+    CHECK(small == base);
+    CHECK(large == base + 0xE000);
+    auto next = static_cast<uint8_t*>(pool.alloc(3000));
+    CHECK(next == base + 0xD000);
+    std::vector<uint8_t*> smalls;
+    for (int i = 0; i < 8; ++i)
+    {
+        smalls.push_back(static_cast<uint8_t*>(pool.alloc(100)));
+        CHECK(smalls.back() == base + 128 * (i + 1));
+    }
+
+    // Freed blocks are reused lowest first, whatever order they were freed in.
+    pool.free(smalls[5]);
+    pool.free(smalls[1]);
+    pool.free(smalls[3]);
+    CHECK(pool.alloc(100) == smalls[1]);
+    CHECK(pool.alloc(100) == smalls[3]);
+    CHECK(pool.alloc(100) == smalls[5]);
+
+    for (auto p: smalls)
+    {
+        pool.free(p);
+    }
+    pool.free(next);
+    pool.free(large);
+    pool.free(small);
+    CHECK(pool.read_stats().used_bytes == 0);
+    CHECK(pool.read_stats().orders[MAX_ORDER - decltype(pool)::MIN_ORDER].free_blocks == 1);
+}
+
+
+struct StashTraits : CountedTraits
+{
+    static constexpr uint32_t STASH_BYTES  = 1024;
+    static constexpr uint16_t STASH_PERIOD = 64;
+};
+
+
+TEST_CASE("Hot orders are served from stashes", "[Buddy]") 
+{
+    constexpr uint8_t MAX_ORDER = 14; // => 16KB
+    ub::BuddyAllocator<MAX_ORDER, 8, StashTraits> pool;
+    using Pool = decltype(pool);
+    auto check_totals = [&]
+    {
+        auto stats = pool.read_stats();
+        CHECK(stats.used_bytes + stats.free_bytes == (1U << MAX_ORDER));
+    };
+
+    // Nothing is stashed until demand has been measured.
+    for (int i = 0; i < 63; ++i)
+    {
+        pool.free(pool.alloc(100));
+    }
+    CHECK(pool.stashed_bytes() == 0);
+
+    // Then the stash is refilled in a batch, and takes freed blocks back up to its 
+    // share of the budget: 1024 bytes is 8 blocks of 128.
+    std::vector<void*> blocks;
+    blocks.push_back(pool.alloc(100));
+    CHECK(pool.stashed_bytes() == 3 * 128);
+    check_totals();
+    for (int i = 0; i < 11; ++i)
+    {
+        blocks.push_back(pool.alloc(100));
+    }
+    for (void* p: blocks)
+    {
+        pool.free(p);
+    }
+    CHECK(pool.stashed_bytes() == 8 * 128);
+    CHECK(pool.read_stats().orders[7 - Pool::MIN_ORDER].free_blocks >= 8);
+    check_totals();
+
+    // The stash shrinks when demand moves to another order.
+    for (int i = 0; i < 5 * 64; ++i)
+    {
+        pool.free(pool.alloc(1000));
+    }
+    CHECK(pool.stashed_bytes() == 1024);
+    CHECK(pool.read_stats().orders[7 - Pool::MIN_ORDER].free_blocks == 0);
+    check_totals();
+
+    // Stashed blocks are given back when a request needs them.
+    void* all = pool.alloc((1U << MAX_ORDER) - 1);
+    CHECK(all != nullptr);
+    CHECK(pool.stashed_bytes() == 0);
+    pool.free(all);
+
+    pool.free(pool.alloc(1000));
+    CHECK(pool.flush_stashes());
+    CHECK_FALSE(pool.flush_stashes());
+    CHECK(pool.read_stats().orders[MAX_ORDER - Pool::MIN_ORDER].free_blocks == 1);
+    CHECK(pool.read_stats().failures == 0);
+}
+
+
+struct TunedTraits : CountedTraits
+{
+    static constexpr uint32_t STASH_BYTES  = 16 * 1024;
+    static constexpr uint16_t STASH_PERIOD = 64;
+};
+
+
+TEST_CASE("Stashes tune themselves to the workload", "[Buddy]") 
+{
+    constexpr uint8_t MAX_ORDER = 16; // => 64KB
+    ub::BuddyAllocator<MAX_ORDER, 8, TunedTraits> pool;
+
+    // Each period has a burst of eight 128 byte blocks, and a steady trickle of small
+    // ones. The burst is an eighth of demand, which alone would give a stash of 2.
+    void* burst[8];
+    auto period = [&](bool bursty)
+    {
+        if (bursty)
+        {
+            for (auto& p: burst)
+            {
+                p = pool.alloc(100);
+            }
+            for (auto p: burst)
+            {
+                pool.free(p);
+            }
+        }
+        for (int i = 0; i < (bursty ? 56 : 64); ++i)
+        {
+            pool.free(pool.alloc(20));
+        }
+    };
+
+    period(true);
+    CHECK(pool.read_stash(7).target == 2);
+    CHECK(pool.read_stash(7).batch == TunedTraits::STASH_BATCH);
+
+    // Misses and merges grow the stash until it holds the whole burst.
+    for (int i = 0; i < 5; ++i)
+    {
+        period(true);
+    }
+    auto tuned = pool.read_stash(7);
+    CHECK(tuned.target >= 8);
+    CHECK(tuned.count == 8);
+    CHECK(tuned.batch > TunedTraits::STASH_BATCH);
+
+    // Once the bursts stop, the idle blocks go back to the pool.
+    for (int i = 0; i < 4; ++i)
+    {
+        period(false);
+    }
+    CHECK(pool.read_stash(7).target == 0);
+    CHECK(pool.read_stash(7).count == 0);
+    CHECK(pool.read_stash(7).batch < tuned.batch);
+    CHECK(pool.stashed_bytes() < 1024);
+}
+
+
+TEST_CASE("Idle stashes decay on demand", "[Buddy]") 
+{
+    constexpr uint8_t MAX_ORDER = 14; // => 16KB
+    ub::BuddyAllocator<MAX_ORDER, 8, StashTraits> pool;
+    using Pool = decltype(pool);
+
+    // A burst fills the stash, and then the pool goes idle part way through a period.
+    std::vector<void*> blocks;
+    for (int i = 0; i < 64 + 8; ++i)
+    {
+        blocks.push_back(pool.alloc(100));
+    }
+    for (void* p: blocks)
+    {
+        pool.free(p);
+    }
+    CHECK(pool.stashed_bytes() == 8 * 128);
+
+    // Nothing retunes an idle pool by itself, but the blocks go back once the stash has 
+    // been idle for a period, and the target follows as the demand decays.
+    pool.decay_stashes();
+    pool.decay_stashes();
+    CHECK(pool.stashed_bytes() == 0);
+    for (int i = 0; i < 8; ++i)
+    {
+        pool.decay_stashes();
+    }
+    CHECK(pool.read_stash(7).target == 0);
+    CHECK(pool.read_stats().orders[MAX_ORDER - Pool::MIN_ORDER].free_blocks == 1);
+
+    // A stash which is in use keeps its blocks.
+    blocks.clear();
+    for (int i = 0; i < 64 + 8; ++i)
+    {
+        blocks.push_back(pool.alloc(100));
+    }
+    for (void* p: blocks)
+    {
+        pool.free(p);
+    }
+    pool.decay_stashes();
+    pool.free(pool.alloc(100));
+    CHECK(pool.stashed_bytes() > 0);
+}
+
+
+struct AdoptingTraits : CountedTraits
+{
+    static constexpr uint8_t MAX_ADOPTED = 2;
+};
+
+
+TEST_CASE("Subtrees can be moved between allocators", "[Buddy]") 
+{
+    constexpr uint8_t MAX_ORDER = 12; // => 4KB
+    ub::BuddyAllocator<MAX_ORDER, 8, CountedTraits> worker;
+    ub::BuddyAllocator<MAX_ORDER, 8, AdoptingTraits> other;
+    using Pool = decltype(worker);
+    auto base = static_cast<uint8_t*>(worker.ptr_from_offset(0));
+
+    // The request's data is all in the first 1KB, and something else is in the second 2KB.
+    auto x = static_cast<uint8_t*>(worker.alloc(100));
+    auto y = static_cast<uint8_t*>(worker.alloc(100));
+    auto z = static_cast<uint8_t*>(worker.alloc(200));
+    void* w = worker.alloc(1500);
+    for (auto p: {x, y, z})
+    {
+        REQUIRE(p < base + 1024);
+        std::memset(p, 5, 100);
+    }
+    REQUIRE(w == base + 2048);
+
+    // Blocks which are free, or part of a larger allocation, can't be detached.
+    auto before = worker.read_stats();
+    CHECK_FALSE(worker.detach(base + 1024, 10));
+    CHECK_FALSE(worker.detach(w, 10));
+    CHECK(worker.read_stats().free_bytes == before.free_bytes);
+    CHECK(worker.read_stats().orders[7 - Pool::MIN_ORDER].free_blocks == before.orders[7 - Pool::MIN_ORDER].free_blocks);
+
+    auto subtree = worker.detach(y, 10);
+    REQUIRE(subtree);
+    CHECK(subtree.base == base);
+    CHECK(worker.read_stats().used_bytes == 2048);
+    CHECK(worker.read_stats().free_bytes == 1024);
+
+    REQUIRE(other.adopt(subtree));
+    CHECK(other.read_stats().used_bytes == 512);
+    CHECK(other.read_stats().free_bytes == 4096 + 512);
+    CHECK(other.contains(x) == false);
+
+    // Frees go to the new owner, and the block goes home when they are all done.
+    other.free(x);
+    other.free(z);
+    CHECK_FALSE(other.release());
+    CHECK(std::all_of(y, y + 100, [](uint8_t b) { return b == 5; }));
+    other.free(y);
+    CHECK(other.read_stats().used_bytes == 0);
+    CHECK(other.read_stats().free_bytes == 4096 + 1024);
+
+    auto home = other.release();
+    REQUIRE(home);
+    CHECK(other.read_stats().free_bytes == 4096);
+    CHECK_FALSE(other.attach(home));
+    CHECK(worker.attach(home));
+    worker.free(w);
+    CHECK(worker.read_stats().used_bytes == 0);
+    CHECK(worker.read_stats().orders[MAX_ORDER - Pool::MIN_ORDER].free_blocks == 1);
+
+    // Data which looks like orders doesn't fool it into detaching half an allocation.
+    auto v = static_cast<uint8_t*>(worker.alloc(2000));
+    REQUIRE(v == base);
+    std::memset(v, 10, 2000);
+    before = worker.read_stats();
+    CHECK_FALSE(worker.detach(v + 1024, 10));
+    CHECK(worker.read_stats().used_bytes == before.used_bytes);
+    CHECK(worker.read_stats().free_bytes == before.free_bytes);
+    worker.free(v);
+}
+
+
+TEST_CASE("Occupancy caps limit the space used by each band of orders", "[Buddy]") 
+{
+    constexpr uint8_t MAX_ORDER = 12; // => 4KB
+    ub::BuddyAllocator<MAX_ORDER, 8, CountedTraits> pool;
+    using Pool = decltype(pool);
+
+    // Small blocks may only use a quarter of the pool between them.
+    pool.set_occupancy_cap(Pool::MIN_ORDER, 6, 1024);
+
+    std::vector<void*> small;
+    while (void* p = pool.alloc(1 + (small.size() % 60)))
+    {
+        small.push_back(p);
+    }
+    CHECK(pool.read_stats().used_bytes <= 1024);
+    CHECK(pool.read_stats().used_bytes > 1024 - 64);
+    auto stats = pool.read_stats();
+    uint32_t capped = 0;
+    for (auto& order: stats.orders)
+    {
+        capped += order.capped;
+    }
+    CHECK(capped == 1);
+    CHECK(stats.failures == 0);
+
+    // Which leaves room for large blocks. Other orders are unaffected.
+    void* large = pool.alloc(2000);
+    CHECK(large != nullptr);
+    void* medium = pool.alloc(100);
+    CHECK(medium != nullptr);
+
+    // Freeing small blocks makes room for more.
+    pool.free(small.back());
+    small.pop_back();
+    CHECK(pool.alloc(1) != nullptr);
+    while (pool.alloc(1) != nullptr)
+    {
+    }
+
+    // Range allocation avoids capped orders.
+    pool.set_occupancy_cap(7, 7, 0);
+    uint32_t size = 0;
+    uint32_t before = pool.read_stats().orders[6 - Pool::MIN_ORDER].capped;
+    CHECK(pool.alloc_range(60, 120, size) == nullptr);
+    CHECK(pool.read_stats().orders[6 - Pool::MIN_ORDER].capped == before + 1);
+    CHECK(pool.read_stats().failures == 0);
+    void* ranged = pool.alloc_range(60, 1000, size);
+    CHECK(size == 511);
+
+    // Removing the cap makes allocation possible again.
+    pool.set_occupancy_cap(Pool::MIN_ORDER, 6, UINT32_MAX);
+    CHECK(pool.alloc(1) != nullptr);
+    pool.free(ranged);
+}
+
+
+namespace {
+
+// A binary search tree of the squares, built at compile time.
+struct Node
+{
+    uint32_t key{};
+    uint16_t left{};
+    uint16_t right{};
+};
+
+using TreePool = ub::ConstexprBuddyAllocator<6, Node>;
+
+constexpr uint16_t build(TreePool& pool, uint32_t first, uint32_t last)
+{
+    if (first > last)
+    {
+        return TreePool::NULL_INDEX;
+    }
+    uint32_t middle = (first + last) / 2;
+    uint16_t node   = pool.alloc(1);
+    pool[node].key   = middle * middle;
+    pool[node].left  = (middle > first) ? build(pool, first, middle - 1) : TreePool::NULL_INDEX;
+    pool[node].right = build(pool, middle + 1, last);
+    return node;
+}
+
+constexpr TreePool make_tree()
+{
+    TreePool pool;
+    // Allocate and free some larger runs on the way to exercise coalescing.
+    auto scratch = pool.alloc(20);
+    pool.free(pool.alloc(3));
+    build(pool, 1, 30);
+    pool.free(scratch);
+    return pool;
+}
+
+constexpr bool contains(const TreePool& pool, uint16_t node, uint32_t key)
+{
+    while (node != TreePool::NULL_INDEX)
+    {
+        if (pool[node].key == key)
+        {
+            return true;
+        }
+        node = (key < pool[node].key) ? pool[node].left : pool[node].right;
+    }
+    return false;
+}
+
+constexpr TreePool tree = make_tree();
+constexpr uint16_t root = 32;
+
+} // namespace {
+
+
+TEST_CASE("Constexpr allocator builds structures at compile time", "[Buddy]") 
+{
+    // The scratch block took the first half, so the tree starts in the second.
+    static_assert(tree[root].key == 15 * 15);
+    static_assert(contains(tree, root, 1));
+    static_assert(contains(tree, root, 900));
+    static_assert(!contains(tree, root, 2));
+    CHECK(contains(tree, root, 49));
+
+    // Exhaust and refill at run time with random sizes, as for BuddyAllocator.
+    ub::ConstexprBuddyAllocator<10> pool;
+    using Pool = decltype(pool);
+    for (uint16_t i = 0; i < 100; ++i)
+    {
+        std::vector<Pool::Index> blocks;
+        uint32_t total = 0;
+        while (total < Pool::SIZE)
+        {
+            uint32_t count = 1 + std::rand() % 64;
+            auto block = pool.alloc(count);
+            if (block == Pool::NULL_INDEX)
+            {
+                break;
+            }
+            CHECK(pool.capacity(block) >= count);
+            CHECK(block % pool.capacity(block) == 0);
+            std::fill(&pool[block], &pool[block] + count, uint8_t(block));
+            total += pool.capacity(block);
+            blocks.push_back(block);
+        }
+
+        std::sort(blocks.begin(), blocks.end());
+        for (size_t b = 1; b < blocks.size(); ++b)
+        {
+            CHECK(blocks[b] >= blocks[b - 1] + pool.capacity(blocks[b - 1]));
+        }
+
+        std::shuffle(blocks.begin(), blocks.end(), std::mt19937{i});
+        for (auto block: blocks)
+        {
+            CHECK(pool[block] == uint8_t(block));
+            pool.free(block);
+        }
+        // Everything coalesced back into a single block.
+        CHECK(pool.alloc(Pool::SIZE) == 0);
+        pool.free(0);
+    }
+}
+
+
+TEST_CASE("Engines can be selected at run time", "[Buddy]") 
+{
+    CHECK(!ub::make_buddy_engine<12>("nonsense"));
+
+    for (auto name: {"freelist", "indexed"})
+    {
+        for (bool thread_safe: {false, true})
+        {
+            ub::AnyBuddyAllocator pool = ub::make_buddy_engine<12>(name, thread_safe);
+            REQUIRE(pool);
+
+            // Exhaust the 4KB pool with 100 byte blocks (128 bytes for the freelist 
+            // engine, 112 for the indexed engine).
+            std::vector<uint8_t*> blocks;
+            while (auto p = static_cast<uint8_t*>(pool.alloc(100)))
+            {
+                std::memset(p, uint8_t(blocks.size()), 100);
+                blocks.push_back(p);
+            }
+            CHECK(blocks.size() == 32);
+            CHECK(pool.alloc(0) == nullptr);
+
+            for (size_t i = 0; i < blocks.size(); ++i)
+            {
+                CHECK(std::all_of(blocks[i], blocks[i] + 100, [i](uint8_t b) { return b == uint8_t(i); }));
+                pool.free(blocks[i]);
+            }
+            pool.free(nullptr);
+
+            // Moving transfers ownership of the engine.
+            ub::AnyBuddyAllocator moved = std::move(pool);
+            CHECK(!pool);
+            void* all = moved.alloc(4000);
+            CHECK(all != nullptr);
+            moved.free(all);
+        }
+    }
+}
+
+
+TEST_CASE("Tasks hold large closures in the pool", "[Buddy]") 
+{
+    using Pool = ub::BuddyAllocator<12, 8, CountedTraits>;
+    using Task = ub::BuddyTask<int(int), Pool>;
+    Pool pool;
+
+    // The order comes from the closure's size, so a sized free matches a plain one.
+    static_assert(Pool::order_of(100) == 7);
+    void* p = pool.alloc(100);
+    pool.free(p, 100);
+    CHECK(pool.read_stats().free_bytes == 4096);
+
+    // Small closures are held in the task itself.
+    int  offset = 5;
+    Task small{pool, [offset](int x) { return x + offset; }};
+    CHECK(!small.pooled());
+    CHECK(small(1) == 6);
+    CHECK(pool.read_stats().used_bytes == 0);
+
+    // A 256 byte closure needs a 512 byte block, which is freed when the task is done.
+    std::array<int, 64> table{};
+    std::iota(table.begin(), table.end(), 0);
+    Task large{pool, [table](int x) { return table[x]; }};
+    CHECK(large.pooled());
+    CHECK(large(42) == 42);
+    CHECK(pool.read_stats().used_bytes == 512);
+
+    // Moving hands over the block without copying the closure.
+    Task moved = std::move(large);
+    CHECK(!large);
+    CHECK(moved(63) == 63);
+    CHECK(pool.read_stats().used_bytes == 512);
+
+    moved = std::move(small);
+    CHECK(moved(2) == 7);
+    CHECK(pool.read_stats().used_bytes == 0);
+
+    // An exhausted pool is reported like an exhausted heap.
+    void* all = pool.alloc(4000);
+    CHECK_THROWS_AS((Task{pool, [table](int x) { return table[x]; }}), std::bad_alloc);
+    pool.free(all);
+    CHECK(pool.read_stats().free_bytes == 4096);
+}
+
+
+struct LazyTraits : CountedTraits
+{
+    static constexpr uint16_t MAX_TAGS         = 4;
+    static constexpr Ages     AGES             = Ages::Full;
+    static constexpr uint8_t  META_CHUNK_ORDER = 10;
+
+    static inline int  chunks = 0;
+    static inline bool refuse = false;
+
+    static void* alloc_metadata(size_t size)
+    {
+        ++chunks;
+        return refuse ? nullptr : std::calloc(1, size);
+    }
+
+    static void free_metadata(void* metadata)
+    {
+        --chunks;
+        std::free(metadata);
+    }
+};
+
+
+TEST_CASE("Metadata is allocated lazily for regions in use", "[Buddy]") 
+{
+    // 64 regions of 1KB.
+    using Pool = ub::BuddyAllocator<16, 8, LazyTraits>;
+    auto pool  = std::make_unique<Pool>();
+    CHECK(pool->lazy_metadata_bytes() == 0);
+    static_assert(Pool::footprint().metadata < 1024);
+
+    void* small = pool->alloc(100, 1);
+    CHECK(LazyTraits::chunks == 1);
+    size_t chunk = pool->lazy_metadata_bytes();
+    CHECK(chunk > 0);
+
+    // A block covering several regions only needs the metadata of its first, until it
+    // is split.
+    void* large = pool->alloc(8000, 2);
+    CHECK(LazyTraits::chunks == 2);
+    void* half = pool->split(large);
+    CHECK(LazyTraits::chunks == 3);
+    CHECK(pool->lazy_metadata_bytes() == 3 * chunk);
+    CHECK(pool->read_tag_stats(2).live_count == 2);
+
+    uint32_t live = 0;
+    pool->for_each_live_age([&](uint8_t, uint16_t, uint32_t) { ++live; });
+    CHECK(live == 3);
+
+    // Regions without metadata hold nothing, so blame skips them.
+    uint32_t blockers = 0;
+    pool->blame(40000, 8, [&](const Pool::BlameRegion&, const Pool::Blocker&) { ++blockers; });
+    CHECK(blockers == 3);
+
+    // Each region's metadata goes as it coalesces.
+    pool->free(half);
+    CHECK(LazyTraits::chunks == 2);
+    pool->free(large);
+    pool->free(small);
+    CHECK(LazyTraits::chunks == 0);
+    CHECK(pool->lazy_metadata_bytes() == 0);
+
+    // If the metadata can't be allocated, neither can the block.
+    LazyTraits::refuse = true;
+    CHECK(pool->alloc(100) == nullptr);
+    CHECK(pool->read_stats().failures == 1);
+    CHECK(pool->read_stats().free_bytes == 65536);
+    LazyTraits::refuse = false;
+
+    // A shrinking realloc() keeps the block whole if it can't be split.
+    void* wide = pool->alloc(4000);
+    LazyTraits::refuse = true;
+    CHECK(pool->realloc(wide, 100) == wide);
+    CHECK(pool->read_stats().used_bytes == 4096);
+    LazyTraits::refuse = false;
+    pool->free(wide);
+    LazyTraits::chunks = 0;
+
+    // Anything left is freed with the allocator.
+    pool->alloc(100);
+    pool.reset();
+    CHECK(LazyTraits::chunks == 0);
+}
+
+
+TEST_CASE("Footprint accounts for every byte", "[Buddy]") 
+{
+    using Plain = ub::BuddyAllocator<12>;
+    constexpr auto plain = Plain::footprint();
+    static_assert(plain.total == sizeof(Plain));
+    static_assert(plain.pool == 4096);
+    static_assert(plain.freelists == Plain::ORDERS * sizeof(void*));
+    static_assert(plain.slack < 64);
+
+    // The stats take a few counters for each order, and a disabled feature takes a byte.
+    using Counted = ub::BuddyAllocator<12, 8, CountedTraits>;
+    static_assert(plain.stats < 8);
+    static_assert(Counted::footprint().stats >= (Counted::ORDERS * 4 * sizeof(uint32_t)));
+
+    // Tracking adds a metadata record for each minimum sized block.
+    using Tagged = ub::BuddyAllocator<12, 8, TaggedTraits>;
+    constexpr auto tagged = Tagged::footprint();
+    static_assert(tagged.total == sizeof(Tagged));
+    static_assert(tagged.metadata >= (4096 >> Tagged::MIN_ORDER) * 4);
+    static_assert(tagged.stats > plain.stats);
+    CHECK(tagged.total > plain.total);
+}
+
+
+#if __has_include(<sys/mman.h>)
+TEST_CASE("Cold allocations overflow to a file backed arena", "[Buddy]") 
+{
+    ub::BuddyAllocator<12, 8, CountedTraits> hot;
+    ub::MappedArena<ub::BuddyAllocator<20, 8, CountedTraits>> cold{std::filesystem::temp_directory_path().c_str()};
+    REQUIRE(cold);
+
+    // The pool is page aligned within the mapping.
+    CHECK(reinterpret_cast<uintptr_t>(cold.pool().ptr_from_offset(0)) % sysconf(_SC_PAGESIZE) == 0);
+
+    ub::TieredAllocator<decltype(hot), decltype(cold)> tiers{hot, cold, 1000};
+
+    // Fill the fast pool.
+    std::vector<void*> blocks;
+    while (void* p = tiers.alloc(1000, true))
+    {
+        if (cold.contains(p))
+        {
+            blocks.push_back(p);
+            break;
+        }
+        CHECK(hot.contains(p));
+        blocks.push_back(p);
+    }
+    CHECK(blocks.size() == 5);
+
+    // Only large cold requests spill.
+    CHECK(tiers.alloc(1000, false) == nullptr);
+    CHECK(tiers.alloc(100, true) == nullptr);
+    void* big = tiers.alloc(100'000, true);
+    REQUIRE(big != nullptr);
+    CHECK(cold.contains(big));
+    std::memset(big, 0x5A, 100'000);
+    cold.advise_cold(big, 100'000);
+    CHECK(static_cast<uint8_t*>(big)[99'999] == 0x5A);
+    blocks.push_back(big);
+
+    for (void* p: blocks)
+    {
+        tiers.free(p);
+    }
+    CHECK(hot.read_stats().used_bytes == 0);
+    CHECK(cold.pool().read_stats().used_bytes == 0);
+
+    // Anonymous arenas work the same way.
+    ub::MappedArena<ub::BuddyAllocator<16, 8, CountedTraits>> anonymous;
+    REQUIRE(anonymous);
+    void* p = anonymous.alloc(60'000);
+    CHECK(anonymous.contains(p));
+    anonymous.free(p);
+}
+
+
+TEST_CASE("Large blocks in an anonymous arena are moved by remapping", "[Buddy]") 
+{
+    using Pool = ub::BuddyAllocator<22, 8, CountedTraits>;
+    ub::MappedArena<Pool> arena;
+    REQUIRE(arena);
+
+    // The block's buddy is in use, so growing it must move it.
+    auto block = static_cast<uint8_t*>(arena.alloc(200'000));
+    void* buddy = arena.alloc(200'000);
+    REQUIRE(block != nullptr);
+    REQUIRE(buddy != nullptr);
+    for (uint32_t i = 0; i < 200'000; ++i)
+    {
+        block[i] = static_cast<uint8_t>(i * 7);
+    }
+
+    auto grown = static_cast<uint8_t*>(arena.realloc(block, 1'000'000));
+    REQUIRE(grown != nullptr);
+    CHECK(grown != block);
+    bool same = true;
+    for (uint32_t i = 0; i < 200'000; ++i)
+    {
+        same = same && (grown[i] == static_cast<uint8_t>(i * 7));
+    }
+    CHECK(same);
+
+    // The old block was freed, and its pages are usable.
+    auto reused = static_cast<uint8_t*>(arena.alloc(200'000));
+    CHECK(reused == block);
+    std::memset(reused, 1, 200'000);
+
+    arena.free(reused);
+    arena.free(buddy);
+    arena.free(grown);
+    CHECK(arena.pool().read_stats().used_bytes == 0);
+    CHECK(arena.pool().read_stats().orders[22 - Pool::MIN_ORDER].free_blocks == 1);
+
+    // A block of exactly the threshold moves all its pages, leaving fresh zero pages 
+    // behind, but keeps the order of the block after it.
+    auto small = static_cast<uint8_t*>(arena.alloc(65'535));
+    void* next = arena.alloc(65'535);
+    REQUIRE(next == small + 65'536);
+    std::memset(small, 9, 65'535);
+    auto moved = static_cast<uint8_t*>(arena.realloc(small, 100'000));
+    REQUIRE(moved != nullptr);
+    CHECK(std::all_of(moved, moved + 65'535, [](uint8_t b) { return b == 9; }));
+    CHECK(small[65'534] == 0);
+    arena.free(next);
+    arena.free(moved);
+    CHECK(arena.pool().read_stats().orders[22 - Pool::MIN_ORDER].free_blocks == 1);
+}
+
+
+TEST_CASE("Free pages in a mapped arena are purged gradually", "[Buddy]") 
+{
+    ub::MappedArena<ub::BuddyAllocator<22, 8, CountedTraits>> arena;
+    REQUIRE(arena);
+    size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    CHECK(arena.dirty_pages() == 0);
+
+    auto start = std::chrono::steady_clock::now();
+    arena.set_decay(std::chrono::milliseconds{3200});
+    arena.purge(start);
+
+    // Touch a megabyte and free it. All but the first page are now dirty, as are the 
+    // pages where the split wrote free list links.
+    void* block = arena.alloc(1'000'000);
+    std::memset(block, 1, arena.pool().capacity(block));
+    arena.free(block);
+    size_t dirty = arena.dirty_pages();
+    CHECK(dirty == (1U << 20) / page - 1 + 2);
+
+    // Within the first epoch nothing is purged, and soon after very little.
+    CHECK(arena.purge(start + std::chrono::milliseconds{50}) == 0);
+    size_t early = arena.purge(start + std::chrono::milliseconds{200});
+    CHECK(early < dirty / 10);
+
+    // Halfway through about half have gone, and by the end all of them.
+    arena.purge(start + std::chrono::milliseconds{1700});
+    CHECK(arena.dirty_pages() < dirty * 3 / 4);
+    CHECK(arena.dirty_pages() > dirty / 4);
+    arena.purge(start + std::chrono::milliseconds{3400});
+    CHECK(arena.dirty_pages() == 0);
+
+    // Purged pages read as zero, and the pool still works.
+    auto bytes = static_cast<uint8_t*>(arena.alloc(1'000'000));
+    CHECK(bytes == block);
+    CHECK(bytes[500'000] == 0);
+    std::memset(bytes, 2, arena.pool().capacity(bytes));
+    arena.free(bytes);
+
+    // With no decay time, everything is purged at once.
+    arena.set_decay(std::chrono::milliseconds{0});
+    CHECK(arena.purge() == dirty);
+    CHECK(arena.dirty_pages() == 0);
+}
+
+TEST_CASE("Page cache holds file extents in the pool", "[Buddy]") 
+{
+    // A file of 40 pages and a bit.
+    std::string path = (std::filesystem::temp_directory_path() / "buddy-page-cache").string();
+    std::vector<uint8_t> contents(40 * 4096 + 100);
+    for (size_t i = 0; i < contents.size(); ++i)
+    {
+        contents[i] = uint8_t((i * 7) ^ (i >> 12));
+    }
+    std::ofstream{path, std::ios::binary}.write(reinterpret_cast<const char*>(contents.data()), contents.size());
+    int fd = ::open(path.c_str(), O_RDONLY);
+    REQUIRE(fd >= 0);
+
+    auto check = [&](auto& cache, size_t size, size_t offset)
+    {
+        std::vector<uint8_t> buffer(size);
+        size_t expected = std::min(size, contents.size() - std::min(offset, contents.size()));
+        CHECK(cache.read(fd, buffer.data(), size, offset) == ssize_t(expected));
+        CHECK(std::equal(buffer.begin(), buffer.begin() + expected, contents.begin() + offset));
+    };
+
+    // The types are passed as null pointers, as for make_buddy_engine().
+    auto exercise = [&](auto* type)
+    {
+        using Cache = std::remove_pointer_t<decltype(type)>;
+        ub::BuddyAllocator<16, 8, CountedTraits> pool;
+        Cache cache{pool};
+
+        // A miss reads the run of pages into one extent, rounded up to a power of two,
+        // which takes a block of exactly its size.
+        check(cache, 3 * 4096, 100);
+        CHECK(cache.read_stats().misses == 1);
+        CHECK(cache.read_stats().cached_bytes == 4 * 4096);
+        CHECK(pool.read_stats().used_bytes == 4 * 4096);
+        check(cache, 4096, 4095);
+        check(cache, 1, 4 * 4096 - 1);
+        CHECK(cache.read_stats().hits == 2);
+
+        // Fill the pool with single pages, then hit the first. The next miss evicts the
+        // second, under either policy.
+        cache.clear();
+        for (size_t page = 0; page < 16; ++page)
+        {
+            check(cache, 4096, page * 4096);
+        }
+        check(cache, 10, 0);
+        check(cache, 10, 16 * 4096);
+        CHECK(cache.read_stats().evictions == 1);
+        auto misses = cache.read_stats().misses;
+        check(cache, 10, 0);
+        CHECK(cache.read_stats().misses == misses);
+        check(cache, 10, 4096);
+        CHECK(cache.read_stats().misses == misses + 1);
+
+        // The evicted pages coalesce, so a read of the whole pool still fits.
+        check(cache, 16 * 4096, 20 * 4096);
+        CHECK(cache.read_stats().cached_bytes == 16 * 4096);
+        CHECK(pool.read_stats().used_bytes == 16 * 4096);
+
+        // Reads stop at the end of the file.
+        check(cache, 8192, 40 * 4096);
+        check(cache, 10, 41 * 4096);
+        check(cache, 100, 50 * 4096);
+
+        // With the pool used by something else, reads go straight to the file.
+        cache.clear();
+        void* other = pool.alloc(40'000);
+        check(cache, 16 * 4096, 4096);
+        CHECK(cache.read_stats().bypasses == 1);
+        pool.free(other);
+
+        cache.invalidate(fd);
+        CHECK(cache.read_stats().cached_bytes == 0);
+        CHECK(pool.read_stats().used_bytes == 0);
+    };
+    exercise(static_cast<ub::BuddyPageCache<ub::BuddyAllocator<16, 8, CountedTraits>, ub::Eviction::Lru>*>(nullptr));
+    exercise(static_cast<ub::BuddyPageCache<ub::BuddyAllocator<16, 8, CountedTraits>, ub::Eviction::Clock>*>(nullptr));
+
+    ::close(fd);
+    std::filesystem::remove(path);
+}
+#endif
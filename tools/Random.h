@@ -0,0 +1,47 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2020 Alan Chambers (unicycle.bloke@gmail.com)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+///////////////////////////////////////////////////////////////////////////////
+// The pseudo-random numbers shared by the tools. A seeded xorshift64* is fast enough
+// not to disturb what is being measured, and gives the same sequence everywhere, so
+// runs of a tool can be compared across machines and compilers.
+#pragma once
+#include <cstdint>
+
+
+namespace ub {
+
+
+class Random
+{
+public:
+    explicit Random(uint64_t seed) : m_state{seed} {}
+
+    // A number in [0, bound).
+    uint32_t operator()(uint32_t bound)
+    {
+        m_state ^= m_state >> 12;
+        m_state ^= m_state << 25;
+        m_state ^= m_state >> 27;
+        return static_cast<uint32_t>((m_state * 2685821657736338717ULL) >> 32) % bound;
+    }
+
+private:
+    uint64_t m_state;
+};
+
+
+} // namespace ub {
@@ -0,0 +1,634 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2020 Alan Chambers (unicycle.bloke@gmail.com)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+///////////////////////////////////////////////////////////////////////////////
+// Runs two small applications over each allocator, because timing alloc() and free()
+// alone says little about what an application will see:
+//
+//   kv   a chained hash table of keys to values of 16 bytes to 2KB, under a mix of
+//        puts (which replace the value), gets and deletes.
+//   dom  a parser which builds a DOM from a 1MB JSON document, walks it and keeps
+//        the last few documents alive while parsing more.
+//
+// Each row reports throughput, the peak growth in resident memory, and how much of
+// that growth was not live data at the peak: the internal and external fragmentation
+// together with anything the allocator keeps back. With no arguments, every workload
+// and engine is run in a fresh process so that one run's heap can't colour the next.
+// Resident memory is read from /proc, so is only reported on Linux. The process exits
+// after each run, so nothing is torn down.
+//
+//     buddy_apps [kv|dom engine]
+#include "BuddyAllocator.h"
+#include "Random.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <string>
+#include <vector>
+
+
+namespace {
+
+
+constexpr uint8_t MAX_POWER = 28;
+
+
+// The engines all take the size back on free(), as the applications know it. This
+// lets the pmr pools be used at all, and lets the buddy engines skip the order byte.
+struct Malloc
+{
+    void* alloc(uint32_t size)
+    {
+        return std::malloc(size);
+    }
+
+    void free(void* pointer, uint32_t)
+    {
+        std::free(pointer);
+    }
+};
+
+
+struct Pmr
+{
+    void* alloc(uint32_t size)
+    {
+        return m_resource.allocate(size, alignof(std::max_align_t));
+    }
+
+    void free(void* pointer, uint32_t size)
+    {
+        m_resource.deallocate(pointer, size, alignof(std::max_align_t));
+    }
+
+    std::pmr::unsynchronized_pool_resource m_resource;
+};
+
+
+template <typename TRAITS>
+struct Buddy
+{
+    using Pool = ub::BuddyAllocator<MAX_POWER, 8, TRAITS>;
+
+    void* alloc(uint32_t size)
+    {
+        void* pointer = m_pool->alloc(size);
+        if (pointer == nullptr)
+        {
+            throw std::bad_alloc{};
+        }
+        return pointer;
+    }
+
+    void free(void* pointer, uint32_t size)
+    {
+        m_pool->free(pointer, size);
+    }
+
+    std::unique_ptr<Pool> m_pool = std::make_unique<Pool>();
+};
+
+
+struct Stashed : ub::BuddyTraits
+{
+    static constexpr uint32_t STASH_BYTES = 64 * 1024;
+};
+
+
+struct TwoEnded : ub::BuddyTraits
+{
+    static constexpr Placement PLACEMENT = Placement::TwoEnded;
+};
+
+
+// Resident and peak resident bytes, or zero if they can't be read.
+struct Rss
+{
+    uint64_t current;
+    uint64_t peak;
+};
+
+Rss read_rss()
+{
+    Rss rss{};
+    std::ifstream status{"/proc/self/status"};
+    std::string   line;
+    while (std::getline(status, line))
+    {
+        if (line.compare(0, 6, "VmRSS:") == 0)
+        {
+            rss.current = std::strtoull(line.c_str() + 6, nullptr, 10) * 1024;
+        }
+        if (line.compare(0, 6, "VmHWM:") == 0)
+        {
+            rss.peak = std::strtoull(line.c_str() + 6, nullptr, 10) * 1024;
+        }
+    }
+    return rss;
+}
+
+
+// Live bytes requested by the application, and the most there have been.
+struct Live
+{
+    void add(uint32_t size)
+    {
+        bytes += size;
+        peak   = std::max(peak, bytes);
+    }
+
+    void remove(uint32_t size)
+    {
+        bytes -= size;
+    }
+
+    uint64_t bytes{};
+    uint64_t peak{};
+};
+
+
+// Checksums are written here so that reads aren't optimised away.
+volatile double g_sink;
+
+
+struct Result
+{
+    double   seconds;
+    double   work;
+    uint64_t peak_live;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Key-value store
+
+constexpr uint32_t KEYS    = 100'000;
+constexpr uint32_t KV_OPS  = 4'000'000;
+constexpr uint32_t BUCKETS = 1U << 17;
+
+
+struct Entry
+{
+    Entry*   next;
+    uint64_t key;
+    uint8_t* value;
+    uint32_t size;
+};
+
+
+// Values are skewed towards the small end, as most caches' are.
+template <typename ENGINE>
+Result kv(ENGINE& engine)
+{
+    std::vector<Entry*> buckets(BUCKETS, nullptr);
+    ub::Random random{1};
+    Live       live;
+    uint64_t checksum = 0;
+
+    auto find = [&](uint64_t key) -> Entry**
+    {
+        Entry** link = &buckets[(key * 0x9E3779B97F4A7C15ULL) >> (64 - 17)];
+        while ((*link != nullptr) && ((*link)->key != key))
+        {
+            link = &(*link)->next;
+        }
+        return link;
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t op = 0; op < KV_OPS; ++op)
+    {
+        uint64_t key    = random(KEYS);
+        uint32_t action = random(10);
+        Entry**  link   = find(key);
+
+        if (action < 5)
+        {
+            // Put: a new value always replaces the old one, as its size may differ.
+            uint32_t size  = (16U << random(8)) - random(16);
+            auto*    value = static_cast<uint8_t*>(engine.alloc(size));
+            std::memset(value, uint8_t(op), size);
+            live.add(size);
+
+            Entry* entry = *link;
+            if (entry == nullptr)
+            {
+                entry  = new (engine.alloc(sizeof(Entry))) Entry{nullptr, key, nullptr, 0};
+                *link  = entry;
+                live.add(sizeof(Entry));
+            }
+            else
+            {
+                engine.free(entry->value, entry->size);
+                live.remove(entry->size);
+            }
+            entry->value = value;
+            entry->size  = size;
+        }
+        else if (action < 9)
+        {
+            if (Entry* entry = *link)
+            {
+                checksum += entry->value[entry->size - 1];
+            }
+        }
+        else if (Entry* entry = *link)
+        {
+            *link = entry->next;
+            live.remove(entry->size + sizeof(Entry));
+            engine.free(entry->value, entry->size);
+            engine.free(entry, sizeof(Entry));
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    g_sink = double(checksum);
+    return {seconds, KV_OPS / 1e6, live.peak};
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// DOM
+
+constexpr uint32_t DOCUMENT_BYTES = 1U << 20;
+constexpr uint32_t DOCUMENTS      = 200;
+constexpr uint32_t KEPT           = 8;
+
+
+// Generates a document of nested objects, arrays, strings and numbers. There are no
+// escapes in the strings, which the parser doesn't need to support.
+class Generator
+{
+public:
+    std::string document()
+    {
+        std::string text = "[";
+        while (text.size() < DOCUMENT_BYTES)
+        {
+            text += (text.size() > 1) ? "," : "";
+            value(text, 0);
+        }
+        return text + "]";
+    }
+
+private:
+    void value(std::string& text, uint32_t depth)
+    {
+        uint32_t kind = (depth < 5) ? m_random(10) : m_random(6);
+        if (kind < 3)
+        {
+            text += std::to_string(m_random(1'000'000)) + "." + std::to_string(m_random(100));
+        }
+        else if (kind < 6)
+        {
+            string(text, m_random(4) ? m_random(16) : m_random(256));
+        }
+        else if (kind < 8)
+        {
+            text += "[";
+            for (uint32_t i = 0, n = m_random(12); i < n; ++i)
+            {
+                text += i ? "," : "";
+                value(text, depth + 1);
+            }
+            text += "]";
+        }
+        else
+        {
+            text += "{";
+            for (uint32_t i = 0, n = m_random(8); i < n; ++i)
+            {
+                text += i ? "," : "";
+                string(text, 3 + m_random(10));
+                text += ":";
+                value(text, depth + 1);
+            }
+            text += "}";
+        }
+    }
+
+    void string(std::string& text, uint32_t length)
+    {
+        text += '"';
+        for (uint32_t i = 0; i < length; ++i)
+        {
+            text += char('a' + m_random(26));
+        }
+        text += '"';
+    }
+
+private:
+    ub::Random m_random{2};
+};
+
+
+// Object members are children with keys. Child arrays grow by doubling, as in most
+// DOM libraries, so a large array leaves a trail of freed smaller ones.
+struct Node
+{
+    enum Kind : uint8_t { Number, String, Array, Object, Literal };
+
+    Kind     kind;
+    uint32_t size;
+    uint32_t capacity;
+    uint32_t key_size;
+    char*    key;
+    union
+    {
+        double number;
+        char*  chars;
+        Node*  children;
+    };
+};
+
+
+template <typename ENGINE>
+class Parser
+{
+public:
+    Parser(ENGINE& engine, Live& live) : m_engine{engine}, m_live{live} {}
+
+    Node parse(const std::string& text)
+    {
+        m_next = text.c_str();
+        Node root{};
+        value(root);
+        return root;
+    }
+
+    void destroy(Node& node)
+    {
+        release(node.key, node.key_size);
+        if (node.kind == Node::String)
+        {
+            release(node.chars, node.size);
+        }
+        if ((node.kind == Node::Array) || (node.kind == Node::Object))
+        {
+            for (uint32_t i = 0; i < node.size; ++i)
+            {
+                destroy(node.children[i]);
+            }
+            release(node.children, node.capacity * sizeof(Node));
+        }
+    }
+
+    static double walk(const Node& node)
+    {
+        double total = node.key_size;
+        switch (node.kind)
+        {
+            case Node::Number:  return total + node.number;
+            case Node::String:  return total + node.size;
+            case Node::Literal: return total;
+            default: break;
+        }
+        for (uint32_t i = 0; i < node.size; ++i)
+        {
+            total += walk(node.children[i]);
+        }
+        return total;
+    }
+
+private:
+    template <typename T>
+    T* acquire(uint32_t size)
+    {
+        m_live.add(size);
+        return static_cast<T*>(m_engine.alloc(size));
+    }
+
+    void release(void* pointer, uint32_t size)
+    {
+        if (size > 0)
+        {
+            m_engine.free(pointer, size);
+            m_live.remove(size);
+        }
+    }
+
+    void value(Node& node)
+    {
+        switch (*m_next)
+        {
+            case '"':
+                node.kind = Node::String;
+                node.chars = string(node.size);
+                break;
+            case '[':
+                node.kind = Node::Array;
+                children(node, ']');
+                break;
+            case '{':
+                node.kind = Node::Object;
+                children(node, '}');
+                break;
+            default:
+            {
+                char* end;
+                node.kind   = Node::Number;
+                node.number = std::strtod(m_next, &end);
+                m_next = end;
+            }
+        }
+    }
+
+    char* string(uint32_t& size)
+    {
+        const char* begin = ++m_next;
+        while (*m_next != '"')
+        {
+            ++m_next;
+        }
+        size = static_cast<uint32_t>(m_next++ - begin);
+        if (size == 0)
+        {
+            return nullptr;
+        }
+        char* chars = acquire<char>(size);
+        std::memcpy(chars, begin, size);
+        return chars;
+    }
+
+    void children(Node& node, char close)
+    {
+        node.size     = 0;
+        node.capacity = 0;
+        node.children = nullptr;
+        ++m_next;
+        while (*m_next != close)
+        {
+            if (node.size == node.capacity)
+            {
+                uint32_t capacity = node.capacity ? node.capacity * 2 : 4;
+                Node*    children = acquire<Node>(capacity * sizeof(Node));
+                if (node.size > 0)
+                {
+                    std::memcpy(children, node.children, node.size * sizeof(Node));
+                }
+                release(node.children, node.capacity * sizeof(Node));
+                node.children = children;
+                node.capacity = capacity;
+            }
+
+            Node& child = node.children[node.size++];
+            child = Node{};
+            if (close == '}')
+            {
+                child.key = string(child.key_size);
+                ++m_next;
+            }
+            value(child);
+            m_next += (*m_next == ',');
+        }
+        ++m_next;
+    }
+
+private:
+    ENGINE&     m_engine;
+    Live&       m_live;
+    const char* m_next{};
+};
+
+
+template <typename ENGINE>
+Result dom(ENGINE& engine, const std::string& text)
+{
+    Live live;
+    Parser<ENGINE> parser{engine, live};
+    std::vector<Node> kept(KEPT);
+    double checksum = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < DOCUMENTS; ++i)
+    {
+        Node& slot = kept[i % KEPT];
+        if (i >= KEPT)
+        {
+            parser.destroy(slot);
+        }
+        slot = parser.parse(text);
+        checksum += parser.walk(slot);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    g_sink = checksum;
+    return {seconds, DOCUMENTS * double(text.size()) / (1 << 20), live.peak};
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+template <typename ENGINE>
+void run(const std::string& workload, const char* name)
+{
+    // Inputs are made before the baseline is read, so that they aren't counted.
+    std::string text = (workload == "dom") ? Generator{}.document() : std::string{};
+    auto engine = std::make_unique<ENGINE>();
+    Rss  before = read_rss();
+
+    Result result{};
+    try
+    {
+        result = (workload == "dom") ? dom(*engine, text) : kv(*engine);
+    }
+    catch (const std::bad_alloc&)
+    {
+        std::printf("%-5s %-16s exhausted\n", workload.c_str(), name);
+        return;
+    }
+
+    Rss after = read_rss();
+    const char* unit = (workload == "dom") ? "MB/s" : "Mop/s";
+    if (after.peak == 0)
+    {
+        std::printf("%-5s %-16s %9.1f %-5s %9s %7s\n", workload.c_str(), name,
+            result.work / result.seconds, unit, "-", "-");
+        return;
+    }
+    double grown = double(after.peak - std::min(after.peak, before.current));
+    double waste = (grown > 0) ? std::max(0.0, 1.0 - result.peak_live / grown) : 0.0;
+    std::printf("%-5s %-16s %9.1f %-5s %7.1fMB %6.1f%%\n", workload.c_str(), name,
+        result.work / result.seconds, unit, grown / (1 << 20), 100 * waste);
+}
+
+
+constexpr const char* ENGINES[] = {"buddy", "buddy-stash", "buddy-two-ended", "malloc", "pmr-pool"};
+
+
+} // namespace {
+
+
+int main(int argc, char* argv[])
+{
+    if (argc == 3)
+    {
+        std::string workload = argv[1];
+        std::string engine   = argv[2];
+        if ((workload != "kv") && (workload != "dom"))
+        {
+            std::printf("Unknown workload\n");
+            return 1;
+        }
+
+        if (engine == ENGINES[0])
+        {
+            run<Buddy<ub::BuddyTraits>>(workload, argv[2]);
+        }
+        else if (engine == ENGINES[1])
+        {
+            run<Buddy<Stashed>>(workload, argv[2]);
+        }
+        else if (engine == ENGINES[2])
+        {
+            run<Buddy<TwoEnded>>(workload, argv[2]);
+        }
+        else if (engine == ENGINES[3])
+        {
+            run<Malloc>(workload, argv[2]);
+        }
+        else if (engine == ENGINES[4])
+        {
+            run<Pmr>(workload, argv[2]);
+        }
+        else
+        {
+            std::printf("Unknown engine\n");
+            return 1;
+        }
+        return 0;
+    }
+
+    std::printf("%-5s %-16s %15s %9s %7s\n", "app", "engine", "throughput", "rss", "waste");
+    for (const char* workload: {"kv", "dom"})
+    {
+        for (const char* engine: ENGINES)
+        {
+            std::fflush(stdout);
+            std::string command = std::string{"\""} + argv[0] + "\" " + workload + " " + engine;
+            if (std::system(command.c_str()) != 0)
+            {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,164 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2020 Alan Chambers (unicycle.bloke@gmail.com)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+///////////////////////////////////////////////////////////////////////////////
+// Fixed alloc/free scenarios for counting instructions and cache misses under
+// cachegrind, which is repeatable where timing on a shared machine is not. Each
+// operation is one alloc() and one free(). The workloads are seeded and there is no
+// timing, so two runs of the same binary count exactly the same. tools/cachegrind.cmake
+// runs each scenario at two operation counts and takes the difference, so that the
+// costs of starting up and filling the pool cancel out.
+//
+//     buddy_bench scenario operations
+#include "BuddyAllocator.h"
+#include "Random.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+
+
+namespace {
+
+
+constexpr uint8_t  MAX_POWER = 20;
+constexpr uint32_t LIVE      = 256;
+
+
+struct Stashed : ub::BuddyTraits
+{
+    static constexpr uint32_t STASH_BYTES = 16 * 1024;
+};
+
+
+// Stores each block so that the calls aren't optimised away.
+void* volatile g_sink;
+
+
+// The same small block over and over: the best case, served from the head of one
+// free list. A live neighbour is pinned first, so that the block's buddy stays in use
+// and the free never coalesces.
+template <typename POOL>
+void lifo(POOL& pool, uint32_t operations)
+{
+    void* pinned = pool.alloc(48);
+    for (uint32_t i = 0; i < operations; ++i)
+    {
+        g_sink = pool.alloc(48);
+        pool.free(g_sink);
+    }
+    pool.free(pinned);
+}
+
+
+// The smallest block from an empty pool: the worst case, which splits the single
+// block all the way down and coalesces it all the way back up.
+template <typename POOL>
+void split(POOL& pool, uint32_t operations)
+{
+    for (uint32_t i = 0; i < operations; ++i)
+    {
+        g_sink = pool.alloc(16);
+        pool.free(g_sink);
+    }
+}
+
+
+// A ring of live blocks of 16 bytes to 2KB, each replaced in turn. If SIZED, the
+// blocks are freed with their sizes.
+template <bool SIZED, typename POOL>
+void mixed(POOL& pool, uint32_t operations)
+{
+    ub::Random random{1};
+    void*      blocks[LIVE];
+    uint32_t   sizes[LIVE];
+    for (uint32_t i = 0; i < LIVE; ++i)
+    {
+        sizes[i]  = (16U << random(8)) - random(16);
+        blocks[i] = pool.alloc(sizes[i]);
+    }
+
+    for (uint32_t i = 0; i < operations; ++i)
+    {
+        uint32_t slot = i % LIVE;
+        if constexpr (SIZED)
+        {
+            pool.free(blocks[slot], sizes[slot]);
+        }
+        else
+        {
+            pool.free(blocks[slot]);
+        }
+        sizes[slot]  = (16U << random(8)) - random(16);
+        blocks[slot] = pool.alloc(sizes[slot]);
+        g_sink = blocks[slot];
+    }
+}
+
+
+template <typename TRAITS, typename SCENARIO>
+void run(SCENARIO scenario, uint32_t operations)
+{
+    using Pool = ub::BuddyAllocator<MAX_POWER, 8, TRAITS>;
+    auto pool = std::make_unique<Pool>();
+    scenario(*pool, operations);
+}
+
+
+} // namespace {
+
+
+int main(int argc, char* argv[])
+{
+    if (argc != 3)
+    {
+        std::printf("Usage: buddy_bench lifo|split|mixed|sized|stash operations\n");
+        return 1;
+    }
+
+    const char* scenario   = argv[1];
+    uint32_t    operations = static_cast<uint32_t>(std::strtoul(argv[2], nullptr, 10));
+    using Plain = ub::BuddyTraits;
+    using Pool  = ub::BuddyAllocator<MAX_POWER, 8, Plain>;
+    using Stash = ub::BuddyAllocator<MAX_POWER, 8, Stashed>;
+
+    if (std::strcmp(scenario, "lifo") == 0)
+    {
+        run<Plain>(lifo<Pool>, operations);
+    }
+    else if (std::strcmp(scenario, "split") == 0)
+    {
+        run<Plain>(split<Pool>, operations);
+    }
+    else if (std::strcmp(scenario, "mixed") == 0)
+    {
+        run<Plain>(mixed<false, Pool>, operations);
+    }
+    else if (std::strcmp(scenario, "sized") == 0)
+    {
+        run<Plain>(mixed<true, Pool>, operations);
+    }
+    else if (std::strcmp(scenario, "stash") == 0)
+    {
+        run<Stashed>(mixed<false, Stash>, operations);
+    }
+    else
+    {
+        std::printf("Unknown scenario: %s\n", scenario);
+        return 1;
+    }
+    return 0;
+}
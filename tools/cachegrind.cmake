@@ -0,0 +1,137 @@
+#///////////////////////////////////////////////////////////////////////////////
+#//
+#// Copyright 2020 Alan Chambers (unicycle.bloke@gmail.com)
+#//
+#// Licensed under the Apache License, Version 2.0 (the "License");
+#// you may not use this file except in compliance with the License.
+#// You may obtain a copy of the License at
+#//
+#// http://www.apache.org/licenses/LICENSE-2.0
+#//
+#// Unless required by applicable law or agreed to in writing, software
+#// distributed under the License is distributed on an "AS IS" BASIS,
+#// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#// See the License for the specific language governing permissions and
+#// limitations under the License.
+#//
+#///////////////////////////////////////////////////////////////////////////////
+# Runs each buddy_bench scenario under cachegrind at two operation counts and takes
+# the difference, so that startup and setup cancel out. Reports instructions, D1
+# misses and LL misses per operation, in thousandths, and fails if any is more than
+# TOLERANCE percent above the baseline. Misses are also allowed an absolute slack, as
+# a good scenario has almost none. If the baselines file has none at all, the check is
+# reported as skipped. Otherwise a scenario without a baseline fails, as the file is
+# out of date. With RECORD set, which only the cachegrind_baselines target does, the
+# baselines file is rewritten from this run instead.
+#
+#     cmake -DVALGRIND=... -DBENCH=... -DBASELINES=... [-DRECORD=ON] -P cachegrind.cmake
+
+set(SCENARIOS lifo split mixed sized stash)
+set(OPERATIONS 20000)
+if (NOT DEFINED TOLERANCE)
+    set(TOLERANCE 5)
+endif()
+set(MISS_SLACK 10)
+
+# Sets out to the summary line's totals for Ir, D1 misses and LL misses.
+function(measure scenario operations out)
+    set(file "${CMAKE_CURRENT_BINARY_DIR}/cachegrind.${scenario}.${operations}")
+    execute_process(
+        COMMAND ${VALGRIND} --tool=cachegrind --cache-sim=yes --cachegrind-out-file=${file}
+                ${BENCH} ${scenario} ${operations}
+        RESULT_VARIABLE result
+        OUTPUT_QUIET
+        ERROR_QUIET)
+    if (NOT result EQUAL 0)
+        message(FATAL_ERROR "cachegrind failed for ${scenario}: ${result}")
+    endif()
+
+    file(STRINGS ${file} events REGEX "^events:")
+    file(STRINGS ${file} summary REGEX "^summary:")
+    string(REGEX REPLACE "^events: *" "" events "${events}")
+    string(REGEX REPLACE "^summary: *" "" summary "${summary}")
+    string(REPLACE " " ";" events "${events}")
+    string(REPLACE " " ";" summary "${summary}")
+
+    set(totals)
+    foreach (group "Ir" "D1mr;D1mw" "ILmr;DLmr;DLmw")
+        set(total 0)
+        foreach (event ${group})
+            list(FIND events ${event} index)
+            if (index LESS 0)
+                message(FATAL_ERROR "cachegrind did not count ${event}")
+            endif()
+            list(GET summary ${index} count)
+            math(EXPR total "${total} + ${count}")
+        endforeach()
+        list(APPEND totals ${total})
+    endforeach()
+    set(${out} ${totals} PARENT_SCOPE)
+endfunction()
+
+set(baselines)
+if (EXISTS ${BASELINES})
+    file(STRINGS ${BASELINES} baselines REGEX "^[a-z]")
+endif()
+if (NOT baselines AND NOT RECORD)
+    message("SKIPPED: ${BASELINES} has no baselines: build the cachegrind_baselines target to record them")
+    return()
+endif()
+
+set(recorded "# scenario Ir D1 LL: thousandths per alloc() and free(), from tools/cachegrind.cmake\n")
+set(failed FALSE)
+set(missing FALSE)
+foreach (scenario ${SCENARIOS})
+    math(EXPR double "${OPERATIONS} * 2")
+    measure(${scenario} ${OPERATIONS} once)
+    measure(${scenario} ${double} twice)
+
+    set(costs)
+    foreach (i 0 1 2)
+        list(GET once ${i} a)
+        list(GET twice ${i} b)
+        math(EXPR cost "(${b} - ${a}) * 1000 / ${OPERATIONS}")
+        list(APPEND costs ${cost})
+    endforeach()
+    string(REPLACE ";" " " line "${scenario} ${costs}")
+    string(APPEND recorded "${line}\n")
+
+    set(baseline)
+    foreach (entry ${baselines})
+        if (entry MATCHES "^${scenario} ")
+            string(REPLACE " " ";" baseline "${entry}")
+            list(REMOVE_AT baseline 0)
+        endif()
+    endforeach()
+
+    if (NOT baseline)
+        message("${line}  (no baseline) MISSING")
+        set(missing TRUE)
+        continue()
+    endif()
+
+    set(verdict "ok")
+    foreach (i 0 1 2)
+        list(GET costs ${i} cost)
+        list(GET baseline ${i} limit)
+        math(EXPR limit "${limit} * (100 + ${TOLERANCE}) / 100")
+        if (i GREATER 0)
+            math(EXPR limit "${limit} + ${MISS_SLACK}")
+        endif()
+        if (cost GREATER limit)
+            set(verdict "REGRESSED")
+            set(failed TRUE)
+        endif()
+    endforeach()
+    string(REPLACE ";" " " baseline "${baseline}")
+    message("${line}  (baseline ${baseline}) ${verdict}")
+endforeach()
+
+if (RECORD)
+    file(WRITE ${BASELINES} "${recorded}")
+    message("Recorded ${BASELINES}")
+elseif (failed)
+    message(FATAL_ERROR "Instruction counts or misses regressed by more than ${TOLERANCE}%")
+elseif (missing)
+    message(FATAL_ERROR "Scenarios have no baseline: build the cachegrind_baselines target to record them")
+endif()
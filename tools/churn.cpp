@@ -0,0 +1,154 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2020 Alan Chambers (unicycle.bloke@gmail.com)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+///////////////////////////////////////////////////////////////////////////////
+// Churns a pool with many small allocations of random size and lifetime, and now and
+// then asks for a large block, to compare how well each placement policy keeps large
+// regions free, and how much time the stashes save. The workload is seeded, so runs 
+// are repeatable.
+#include "BuddyAllocator.h"
+#include "Random.h"
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+
+namespace {
+
+
+// The workload is steered by the used bytes in the stats.
+struct Counted : ub::BuddyTraits
+{
+    static constexpr bool STATS = true;
+};
+
+
+struct TwoEnded : Counted
+{
+    static constexpr Placement PLACEMENT   = Placement::TwoEnded;
+    static constexpr uint8_t   LARGE_ORDER = 14;
+};
+
+
+struct Stashed : Counted
+{
+    static constexpr uint32_t STASH_BYTES = 16 * 1024;
+};
+
+
+constexpr uint8_t  MAX_POWER   = 20;
+constexpr uint32_t STEPS       = 400'000;
+constexpr uint32_t LARGE_EVERY = 64;
+constexpr uint32_t LARGE_HOLD  = 16;
+constexpr uint32_t PHASE       = 10'000;
+
+
+struct Result
+{
+    uint32_t large_attempts;
+    uint32_t large_successes;
+    uint32_t small_failures;
+    double   seconds;
+};
+
+
+// Small requests are 16 bytes to 1KB, skewed towards the small end, and are freed at
+// random. The live small bytes swing between a fifth and four fifths of the pool, so 
+// that the survivors of each busy phase are scattered. Large requests are 32KB to 
+// 256KB, and each is held briefly while small requests carry on.
+template <typename TRAITS>
+Result churn(uint64_t seed)
+{
+    using Pool = ub::BuddyAllocator<MAX_POWER, 8, TRAITS>;
+    auto       pool = std::make_unique<Pool>();
+    ub::Random random{seed};
+    Result     result{};
+
+    std::vector<void*> small;
+    void* large = nullptr;
+    auto  start = std::chrono::steady_clock::now();
+
+    for (uint32_t step = 0; step < STEPS; ++step)
+    {
+        uint32_t target = (((step / PHASE) % 2) ? 4 : 1) * ((1U << MAX_POWER) / 5);
+
+        if ((step % LARGE_EVERY) == 0)
+        {
+            ++result.large_attempts;
+            large = pool->alloc((32U << 10) << random(4));
+            result.large_successes += (large != nullptr);
+        }
+        if ((step % LARGE_EVERY) == LARGE_HOLD)
+        {
+            pool->free(large);
+        }
+
+        if ((pool->read_stats().used_bytes < target) || small.empty())
+        {
+            if (void* p = pool->alloc(16U << random(7) | random(16)))
+            {
+                small.push_back(p);
+            }
+            else
+            {
+                ++result.small_failures;
+            }
+        }
+        else
+        {
+            uint32_t i = random(static_cast<uint32_t>(small.size()));
+            pool->free(small[i]);
+            small[i] = small.back();
+            small.pop_back();
+        }
+    }
+
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+
+template <typename TRAITS>
+void row(const char* placement)
+{
+    constexpr uint64_t SEEDS[] = {1, 2, 3, 4, 5};
+    Result total{};
+    for (uint64_t seed: SEEDS)
+    {
+        Result r = churn<TRAITS>(seed);
+        total.large_attempts  += r.large_attempts;
+        total.large_successes += r.large_successes;
+        total.small_failures  += r.small_failures;
+        total.seconds         += r.seconds;
+    }
+    std::printf("%-10s %10u %10u %9.2f%% %10u %9.3f\n", placement, total.large_attempts,
+        total.large_successes, 100.0 * total.large_successes / total.large_attempts,
+        total.small_failures, total.seconds);
+}
+
+
+} // namespace {
+
+
+int main()
+{
+    std::printf("placement    attempts  successes   success  small_fail   seconds\n");
+    row<Counted>("lifo");
+    row<TwoEnded>("two-ended");
+    row<Stashed>("stash");
+    return 0;
+}
@@ -0,0 +1,144 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2020 Alan Chambers (unicycle.bloke@gmail.com)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+///////////////////////////////////////////////////////////////////////////////
+// Posts millions of tasks to a simple executor, which queues them in batches and then
+// runs them in order, to compare std::function, whose large closures go to the heap,
+// with BuddyTask, whose large closures go to a pool. Each row is one closure size.
+#include "BuddyTask.h"
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <vector>
+
+
+namespace {
+
+
+using Pool = ub::BuddyAllocator<20>;
+
+constexpr uint32_t TASKS = 4'000'000;
+constexpr uint32_t BATCH = 1'000;
+
+
+// Queues tasks until the batch is full, then runs and destroys them all.
+template <typename TASK>
+class Executor
+{
+public:
+    Executor()
+    {
+        m_queue.reserve(BATCH);
+    }
+
+    template <typename... ARGS>
+    void post(ARGS&&... args)
+    {
+        m_queue.emplace_back(std::forward<ARGS>(args)...);
+        if (m_queue.size() == BATCH)
+        {
+            drain();
+        }
+    }
+
+    void drain()
+    {
+        for (auto& task: m_queue)
+        {
+            m_sum += task();
+        }
+        m_queue.clear();
+    }
+
+    uint64_t sum() const
+    {
+        return m_sum;
+    }
+
+private:
+    std::vector<TASK> m_queue;
+    uint64_t          m_sum{};
+};
+
+
+// A closure capturing WORDS 64-bit values, which reads one of them when run.
+template <size_t WORDS>
+auto make_closure(uint32_t i)
+{
+    std::array<uint64_t, WORDS> data{};
+    data[i % WORDS] = i;
+    return [data, i]{ return data[i % WORDS]; };
+}
+
+
+template <typename F>
+double time(F&& f)
+{
+    auto start = std::chrono::steady_clock::now();
+    f();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+template <size_t WORDS>
+void row()
+{
+    using Closure = decltype(make_closure<WORDS>(0));
+
+    Executor<std::function<uint64_t()>> heap;
+    double heap_seconds = time([&]
+    {
+        for (uint32_t i = 0; i < TASKS; ++i)
+        {
+            heap.post(make_closure<WORDS>(i));
+        }
+        heap.drain();
+    });
+
+    auto pool = std::make_unique<Pool>();
+    Executor<ub::BuddyTask<uint64_t(), Pool>> buddy;
+    double buddy_seconds = time([&]
+    {
+        for (uint32_t i = 0; i < TASKS; ++i)
+        {
+            buddy.post(*pool, make_closure<WORDS>(i));
+        }
+        buddy.drain();
+    });
+
+    if (heap.sum() != buddy.sum())
+    {
+        std::printf("Mismatched results\n");
+    }
+    std::printf("%7zu %12.3f %12.3f %9.2fx\n", sizeof(Closure), heap_seconds, buddy_seconds,
+        heap_seconds / buddy_seconds);
+}
+
+
+} // namespace {
+
+
+int main()
+{
+    std::printf("closure  std::function   BuddyTask   speedup\n");
+    row<1>();
+    row<4>();
+    row<16>();
+    row<64>();
+    return 0;
+}
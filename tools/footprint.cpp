@@ -0,0 +1,107 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright 2020 Alan Chambers (unicycle.bloke@gmail.com)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+///////////////////////////////////////////////////////////////////////////////
+// Prints the memory overhead of BuddyAllocator for a range of pool sizes, alignments
+// and features, so that the cost of each feature can be judged before choosing it.
+// The figures are for the platform this is compiled for: pointer size matters.
+#include "BuddyAllocator.h"
+#include <cstdio>
+
+
+namespace {
+
+
+struct Counted : ub::BuddyTraits
+{
+    static constexpr bool STATS = true;
+};
+
+struct Tags : ub::BuddyTraits
+{
+    static constexpr uint16_t MAX_TAGS = 16;
+};
+
+struct Sampled : ub::BuddyTraits
+{
+    static constexpr uint32_t SAMPLE_INTERVAL = 512 * 1024;
+};
+
+struct FullAges : ub::BuddyTraits
+{
+    static constexpr Ages AGES = Ages::Full;
+};
+
+struct Stashed : ub::BuddyTraits
+{
+    static constexpr uint32_t STASH_BYTES = 4096;
+};
+
+struct Everything : ub::BuddyTraits
+{
+    static constexpr bool     STATS           = true;
+    static constexpr uint16_t MAX_TAGS        = 16;
+    static constexpr uint32_t SAMPLE_INTERVAL = 512 * 1024;
+    static constexpr Ages     AGES            = Ages::Full;
+    static constexpr uint32_t STASH_BYTES     = 4096;
+};
+
+// As Everything, but the metadata is allocated for each 1KB region as it is used, and
+// isn't counted here.
+struct Lazy : Everything
+{
+    static constexpr uint8_t META_CHUNK_ORDER = 10;
+};
+
+
+template <uint8_t MAX_POWER, uint8_t ALIGNMENT, typename TRAITS>
+void row(const char* features)
+{
+    constexpr auto f = ub::BuddyAllocator<MAX_POWER, ALIGNMENT, TRAITS>::footprint();
+    std::printf("%5u %5u  %-10s %10zu %6zu %5zu %6zu %9zu %8zu %5zu %5zu %5zu %10zu %7.2f%%\n", 
+        MAX_POWER, ALIGNMENT, features, f.pool, f.freelists, f.caps, f.stats, f.metadata, 
+        f.profiler, f.stash, f.dummy, f.slack, f.total, 100.0 * (f.total - f.pool) / f.pool);
+}
+
+
+template <uint8_t MAX_POWER, uint8_t ALIGNMENT>
+void rows()
+{
+    row<MAX_POWER, ALIGNMENT, ub::BuddyTraits>("none");
+    row<MAX_POWER, ALIGNMENT, Counted>("stats");
+    row<MAX_POWER, ALIGNMENT, Tags>("tags");
+    row<MAX_POWER, ALIGNMENT, Sampled>("sampled");
+    row<MAX_POWER, ALIGNMENT, FullAges>("ages");
+    row<MAX_POWER, ALIGNMENT, Stashed>("stash");
+    row<MAX_POWER, ALIGNMENT, Everything>("all");
+    row<MAX_POWER, ALIGNMENT, Lazy>("all-lazy");
+}
+
+
+} // namespace {
+
+
+int main()
+{
+    std::printf("power align  features         pool  lists  caps  stats  metadata profiler stash dummy slack      total overhead\n");
+    rows<10, 8>();
+    rows<10, 64>();
+    rows<12, 8>();
+    rows<16, 8>();
+    rows<16, 64>();
+    rows<20, 8>();
+    return 0;
+}